@@ -0,0 +1,84 @@
+#include "Batch.h"
+
+#include <omp.h>
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+BatchRenderer::BatchRenderer(Scene *scene, const RenderSettings &settings) : scene(scene), settings(settings) {}
+
+bool BatchRenderer::LoadBatchFile(const char *fileName) {
+	std::ifstream file(fileName);
+
+	if(!file.is_open()) {
+		std::cerr << "Error opening batch file!" << std::endl;
+		return false;
+	}
+
+	RenderView current = SceneView(scene);
+
+	std::string line;
+	while(std::getline(file, line)) {
+		std::vector<std::string> args = loader.ParseArgsFromLine(line);
+
+		if(args.empty() || args[0][0] == '#') {
+			continue;
+		}
+
+		if(args[0] == "render:") {
+			RenderView view = current;
+			SceneLoader::FinishCamera(view.camera);
+			views.push_back(view);
+		}
+		else if(!loader.ParseViewDirective(args, current.camera, current.width, current.height, current.outputImage)) {
+			std::cerr << "Unknown batch directive: " << args[0] << std::endl;
+		}
+	}
+
+	file.close();
+
+	return true;
+}
+
+bool BatchRenderer::RenderAll(int jobs) {
+	if(views.empty()) {
+		return true;
+	}
+
+	jobs = std::clamp(jobs, 1, (int) views.size());
+	RenderSettings jobSettings = settings;
+	jobSettings.threadCount = std::max(settings.threadCount / jobs, 1);
+	double deadline = omp_get_wtime() + settings.timeBudget;
+	bool allWritten = true;
+
+	omp_set_max_active_levels(2);		// Each job runs its own tile team
+	#pragma omp parallel for num_threads(jobs) schedule(dynamic, 1)
+	for(uint v = 0; v < views.size(); v++) {
+		const RenderView &view = views[v];
+
+		// A budget covers the whole batch. Views then go one at a time, each with an even share of what is left
+		RenderSettings viewSettings = jobSettings;
+		if(settings.timeBudget > 0) {
+			viewSettings.timeBudget = std::max((deadline - omp_get_wtime()) / (views.size() - v), 0.001);
+		}
+
+		double start = omp_get_wtime();
+		Renderer renderer = Renderer(scene, view, viewSettings);
+		renderer.Render();
+		bool written = renderer.WriteImage(view.outputImage.c_str());
+		double end = omp_get_wtime();
+
+		#pragma omp critical(batchReport)
+		{
+			if(written) {
+				std::cout << "Rendered " << view.outputImage << " (" << view.width << "x" << view.height << ") in " << end - start << " seconds" << std::endl;
+			}
+			else {
+				allWritten = false;
+			}
+		}
+	}
+
+	return allWritten;
+}
@@ -0,0 +1,27 @@
+#ifndef BATCH_INCLUDED
+#define BATCH_INCLUDED
+
+#include "Renderer.h"
+#include "scene/SceneLoader.h"
+
+#include <vector>
+
+// Renders a list of views over one loaded scene, so parsing and BVH builds are paid once
+// A batch file takes the scene file's camera, film and output directives. Each "render:" line
+// queues the view as it stands, and the next view starts from it
+class BatchRenderer {
+public:
+	BatchRenderer(Scene *scene, const RenderSettings &settings);
+
+	bool LoadBatchFile(const char *fileName);
+	bool RenderAll(int jobs);		// Up to jobs views at once, the threads split between them. A time budget is for the whole batch. False if any image could not be written
+
+	std::vector<RenderView> views;
+
+private:
+	Scene *scene;
+	RenderSettings settings;
+	SceneLoader loader;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "Renderer.h"
+
+#include <omp.h>
+
+#include <iostream>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+
+#include <unistd.h>		// fsync
+
+#define CHECKPOINT_MAGIC "RTCKPT4"		// Bump when the layout below changes
+
+// Sits at the front of the checkpoint file
+// Followed by one done flag per tile of the pass, then the colour sums and sample counts of every pixel
+// The settings that change the image and the hash of the scene file are in here, so a checkpoint from another render is never picked up
+struct CheckpointHeader {
+	char magic[8];
+	uint64_t renderHash;
+	int32_t width, height, tileSize;
+	int32_t passes, progressive;
+	int32_t samplesPerPixel, maxSamplesPerPixel;
+	float adaptiveThreshold;
+	int32_t maxDepth;
+	float minRayWeight;
+	int32_t triangleCount, sphereCount, lightCount;
+	Camera camera;
+	Tile region;		// Crop window
+
+	int32_t pass, tileCount;		// Where the render got to
+	int64_t totalSamples;
+};
+
+static void FillHeader(CheckpointHeader &header, uint64_t renderHash, const Scene *scene, const RenderView &view, const RenderSettings &settings, const Tile &region) {
+	header = CheckpointHeader();		// All 4 and 8 byte fields, so there is no padding for SameRender to trip on
+	strncpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.renderHash = renderHash;
+	header.width = view.width;
+	header.height = view.height;
+	header.tileSize = settings.tileSize;
+	header.passes = settings.passes;
+	header.progressive = settings.progressive;
+	header.samplesPerPixel = scene->samplesPerPixel;
+	header.maxSamplesPerPixel = scene->maxSamplesPerPixel;
+	header.adaptiveThreshold = scene->adaptiveThreshold;
+	header.maxDepth = scene->maxDepth;
+	header.minRayWeight = scene->minRayWeight;
+	header.triangleCount = scene->triangles.size() + scene->instances.size();
+	header.sphereCount = scene->spheres.size();
+	header.lightCount = scene->directionalLights.size() + scene->pointLights.size() + scene->spotLights.size();
+	header.camera = view.camera;
+	header.region = region;
+}
+
+// Settings part of the header, the progress fields may differ
+static bool SameRender(const CheckpointHeader &a, const CheckpointHeader &b) {
+	return memcmp(&a, &b, offsetof(CheckpointHeader, pass)) == 0;
+}
+
+void Renderer::EnableCheckpoints(const std::string &path, double interval, uint64_t renderHash) {
+	checkpointPath = path;
+	checkpointInterval = interval;
+	checkpointHash = renderHash;
+	lastCheckpoint = omp_get_wtime();
+
+	if(checkpointAccum == NULL) {
+		checkpointAccum = new Color[imageWidth * imageHeight];
+		checkpointCounts = new int[imageWidth * imageHeight];
+	}
+
+	std::cout << "Checkpointing to " << path << " every " << interval << " seconds" << std::endl;
+}
+
+// A pass starts from the sums as they are now, unless a resumed checkpoint already has some of its tiles
+void Renderer::BeginCheckpointPass(int pass, int tileCount) {
+	if(pass == checkpointPass && (int) tileDone.size() == tileCount) {
+		return;
+	}
+
+	std::copy(accum, accum + imageWidth * imageHeight, checkpointAccum);
+	memcpy(checkpointCounts, sampleCounts, imageWidth * imageHeight * sizeof(int));
+	tileDone.assign(tileCount, 0);
+	checkpointPass = pass;
+	checkpointSamples = totalSamples;
+}
+
+// Only whole tiles make it into the checkpoint, so none is counted twice after a restart
+void Renderer::FinishCheckpointTile(const Tile &tile, int tileIdx, long long tileSamples) {
+	#pragma omp critical(checkpoint)
+	{
+		for(int j = tile.y0; j < tile.y1; j++) {
+			int row = tile.x0 + j * imageWidth;
+			std::copy(accum + row, accum + row + (tile.x1 - tile.x0), checkpointAccum + row);
+			memcpy(checkpointCounts + row, sampleCounts + row, (tile.x1 - tile.x0) * sizeof(int));
+		}
+		tileDone[tileIdx] = 1;
+		checkpointSamples += tileSamples;
+
+		// Other threads keep tracing, they only wait here if they finish a tile meanwhile
+		if(omp_get_wtime() - lastCheckpoint >= checkpointInterval) {
+			WriteCheckpoint();
+			lastCheckpoint = omp_get_wtime();
+		}
+	}
+}
+
+// Written to a temporary name and synced before the rename, so a kill at any point leaves the last good one
+void Renderer::WriteCheckpoint() {
+	std::string tempPath = checkpointPath + ".tmp";
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if(!file) {
+		std::cerr << "Could not write checkpoint " << tempPath << std::endl;
+		return;
+	}
+
+	CheckpointHeader header;
+	FillHeader(header, checkpointHash, scene, view, settings, region);
+	header.pass = checkpointPass;
+	header.tileCount = tileDone.size();
+	header.totalSamples = checkpointSamples;
+
+	size_t pixels = imageWidth * imageHeight;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(tileDone.data(), 1, tileDone.size(), file) == tileDone.size();
+	ok = ok && fwrite(checkpointAccum, sizeof(Color), pixels, file) == pixels;
+	ok = ok && fwrite(checkpointCounts, sizeof(int), pixels, file) == pixels;
+	ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+
+	if(!ok || rename(tempPath.c_str(), checkpointPath.c_str()) != 0) {
+		std::cerr << "Could not write checkpoint " << checkpointPath << std::endl;
+		remove(tempPath.c_str());
+		return;
+	}
+
+	int done = 0;
+	for(char flag : tileDone) {
+		done += flag;
+	}
+	if(settings.verbose) {
+		std::cout << "Checkpoint: pass " << checkpointPass + 1 << ", " << done << "/" << tileDone.size() << " tiles" << std::endl;
+	}
+}
+
+bool Renderer::ResumeCheckpoint() {
+	FILE *file = fopen(checkpointPath.c_str(), "rb");
+	if(!file) {
+		std::cout << "No checkpoint at " << checkpointPath << ", starting from scratch" << std::endl;
+		return false;
+	}
+
+	CheckpointHeader expected;
+	FillHeader(expected, checkpointHash, scene, view, settings, region);
+	CheckpointHeader header;
+	if(fread(&header, sizeof(header), 1, file) != 1 || !SameRender(header, expected) || header.pass < 0 || header.pass >= header.passes || header.tileCount < 0) {
+		std::cerr << "Checkpoint " << checkpointPath << " is from another scene or settings, starting from scratch" << std::endl;
+		fclose(file);
+		return false;
+	}
+
+	size_t pixels = imageWidth * imageHeight;
+	std::vector<char> done(header.tileCount);
+	bool ok = fread(done.data(), 1, done.size(), file) == done.size();
+	ok = ok && fread(checkpointAccum, sizeof(Color), pixels, file) == pixels;
+	ok = ok && fread(checkpointCounts, sizeof(int), pixels, file) == pixels;
+	ok = ok && fgetc(file) == EOF;
+	fclose(file);
+	if(!ok) {
+		std::cerr << "Checkpoint " << checkpointPath << " is truncated, starting from scratch" << std::endl;
+		return false;
+	}
+
+	std::copy(checkpointAccum, checkpointAccum + pixels, accum);
+	memcpy(sampleCounts, checkpointCounts, pixels * sizeof(int));
+	tileDone = done;
+	checkpointPass = header.pass;
+	resumePass = header.pass;
+	totalSamples = header.totalSamples;
+	checkpointSamples = header.totalSamples;
+
+	int finished = 0;
+	for(char flag : tileDone) {
+		finished += flag;
+	}
+	std::cout << "Resuming at pass " << resumePass + 1 << "/" << settings.passes << " with " << finished << "/" << tileDone.size() << " tiles done" << std::endl;
+
+	return true;
+}
+
+// Every tile of the last pass is done by now, so this is the finished render
+void Renderer::KeepCheckpoint() {
+	if(!checkpointPath.empty() && checkpointPass >= 0) {
+		WriteCheckpoint();
+		std::cerr << "Kept the finished render in " << checkpointPath << ", rerun with -resume once the image can be written" << std::endl;
+	}
+}
+
+void Renderer::RemoveCheckpoint() {
+	if(!checkpointPath.empty()) {
+		remove(checkpointPath.c_str());
+	}
+}
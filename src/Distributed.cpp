@@ -0,0 +1,407 @@
+#include "Distributed.h"
+
+#include <omp.h>
+
+#include <iostream>
+#include <cstdio>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#define WORKER_WAIT_SECONDS 10		// With no worker connected for this long, the coordinator renders alone
+#define CONNECT_ATTEMPTS 50			// Workers may start before the coordinator listens, 100ms apart
+
+static bool WriteAll(int fd, const void *data, size_t size) {
+	const char *bytes = (const char *) data;
+	while(size > 0) {
+		ssize_t written = write(fd, bytes, size);
+		if(written <= 0) {
+			return false;
+		}
+		bytes += written;
+		size -= written;
+	}
+
+	return true;
+}
+
+static bool ReadAll(int fd, void *data, size_t size) {
+	char *bytes = (char *) data;
+	while(size > 0) {
+		ssize_t got = read(fd, bytes, size);
+		if(got <= 0) {
+			return false;
+		}
+		bytes += got;
+		size -= got;
+	}
+
+	return true;
+}
+
+static int TileArea(const Tile &tile) {
+	return (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+}
+
+// Reads give up after this long, so a peer that stalls or vanishes can't hang the other end
+static void SetReadTimeout(int fd, int seconds) {
+	timeval timeout = {};
+	timeout.tv_sec = seconds;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// The same fields the checkpoint header compares, plus the scene file itself for materials and anything else it sets
+uint64_t RenderHash(const char *sceneFile, const Scene *scene) {
+	uint64_t hash = FNV_OFFSET;
+
+	FILE *file = fopen(sceneFile, "rb");
+	if(file) {
+		char buffer[4096];
+		size_t got;
+		while((got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+			hash = HashBytes(hash, buffer, got);
+		}
+		fclose(file);
+	}
+
+	int32_t counts[] = {	scene->imageWidth, scene->imageHeight, scene->samplesPerPixel, scene->maxSamplesPerPixel, scene->maxDepth,
+							(int32_t) scene->triangles.size(), (int32_t) scene->instances.size(), (int32_t) scene->spheres.size(),
+							(int32_t) (scene->directionalLights.size() + scene->pointLights.size() + scene->spotLights.size())	};
+	float values[] = {scene->adaptiveThreshold, scene->minRayWeight};
+	const Camera &camera = scene->camera;
+	float view[] = {	camera.eye.x, camera.eye.y, camera.eye.z, camera.fwd.x, camera.fwd.y, camera.fwd.z,
+						camera.up.x, camera.up.y, camera.up.z, camera.right.x, camera.right.y, camera.right.z, camera.halfAngleFov	};
+	hash = HashBytes(hash, counts, sizeof(counts));
+	hash = HashBytes(hash, values, sizeof(values));
+	hash = HashBytes(hash, view, sizeof(view));
+
+	return hash;
+}
+
+RenderCoordinator::RenderCoordinator(const RenderSettings &settings) : settings(settings) {}
+
+RenderCoordinator::~RenderCoordinator() {
+	for(int worker : workers) {
+		close(worker);
+	}
+	if(listener >= 0) {
+		close(listener);
+	}
+	for(int child : children) {
+		waitpid(child, NULL, 0);
+	}
+}
+
+bool RenderCoordinator::Listen(int requestedPort) {
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(requestedPort);
+	socklen_t length = sizeof(address);
+	if(listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 16) != 0 || getsockname(listener, (sockaddr *) &address, &length) != 0) {
+		std::cerr << "Could not listen on port " << requestedPort << std::endl;
+		return false;
+	}
+
+	port = ntohs(address.sin_port);
+	signal(SIGPIPE, SIG_IGN);		// A dead worker shows up as a failed write instead
+	std::cout << "Coordinator listening on port " << port << std::endl;
+
+	return true;
+}
+
+// Runs this same binary again as workers on localhost. Their log goes to /dev/null
+void RenderCoordinator::SpawnLocalWorkers(int count, const std::vector<std::string> &workerArgs) {
+	std::string address = "127.0.0.1:" + std::to_string(port);
+
+	for(int i = 0; i < count; i++) {
+		pid_t child = fork();
+		if(child == 0) {
+			std::vector<char *> argv;
+			for(const std::string &arg : workerArgs) {
+				argv.push_back((char *) arg.c_str());
+			}
+			argv.push_back((char *) "-worker");
+			argv.push_back((char *) address.c_str());
+			argv.push_back(NULL);
+
+			int devNull = open("/dev/null", O_WRONLY);
+			dup2(devNull, STDOUT_FILENO);
+
+			execv("/proc/self/exe", argv.data());
+			_exit(1);
+		}
+		if(child > 0) {
+			children.push_back(child);
+		}
+	}
+}
+
+bool RenderCoordinator::AcceptWorker() {
+	int worker = accept(listener, NULL, NULL);
+	if(worker < 0) {
+		return false;
+	}
+
+	SetReadTimeout(worker, WORKER_TIMEOUT_SECONDS);
+
+	WorkerHello hello;
+	if(!ReadAll(worker, &hello, sizeof(hello)) || hello.magic != WORKER_MAGIC) {
+		close(worker);
+		return false;
+	}
+	if(hello.width != scene->imageWidth || hello.height != scene->imageHeight || hello.triangleCount != (int) scene->triangles.size() || hello.sphereCount != (int) scene->spheres.size()) {
+		std::cerr << "Worker loaded a different scene, dropping it" << std::endl;
+		close(worker);
+		return false;
+	}
+	if(hello.renderHash != renderHash) {
+		std::cerr << "Worker has a different scene file or render options, dropping it" << std::endl;
+		close(worker);
+		return false;
+	}
+
+	int noDelay = 1;
+	setsockopt(worker, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	workers.push_back(worker);
+	workerJobs.push_back(Tile{0, 0, 0, 0});
+	workerBusy.push_back(false);
+	workerSent.push_back(0);
+	std::cout << "Worker " << workers.size() << " connected" << std::endl;
+
+	return true;
+}
+
+bool RenderCoordinator::SendJob(int worker, const Tile &tile) {
+	WorkerJob job;
+	job.tile = tile;
+	job.done = 0;
+
+	if(!WriteAll(workers[worker], &job, sizeof(job))) {
+		return false;
+	}
+
+	workerJobs[worker] = tile;
+	workerBusy[worker] = true;
+	workerSent[worker] = omp_get_wtime();
+
+	return true;
+}
+
+bool RenderCoordinator::ReceiveResult(int worker, Renderer &renderer) {
+	WorkerResult result;
+	if(!ReadAll(workers[worker], &result, sizeof(result))) {
+		return false;
+	}
+
+	const Tile &tile = workerJobs[worker];
+	if(result.tile.x0 != tile.x0 || result.tile.y0 != tile.y0 || result.tile.x1 != tile.x1 || result.tile.y1 != tile.y1) {
+		return false;
+	}
+
+	int area = TileArea(tile);
+	std::vector<Color> colors(area);
+	std::vector<int> counts(area);
+	if(!ReadAll(workers[worker], colors.data(), area * sizeof(Color)) || !ReadAll(workers[worker], counts.data(), area * sizeof(int))) {
+		return false;
+	}
+
+	renderer.AddRegion(tile, colors.data(), counts.data());
+	workerBusy[worker] = false;
+
+	return true;
+}
+
+// Its job, if any, goes back on the queue
+void RenderCoordinator::DropWorker(int worker) {
+	if(workerBusy[worker]) {
+		pendingJobs.push_back(workerJobs[worker]);
+	}
+	close(workers[worker]);
+
+	workers.erase(workers.begin() + worker);
+	workerJobs.erase(workerJobs.begin() + worker);
+	workerBusy.erase(workerBusy.begin() + worker);
+	workerSent.erase(workerSent.begin() + worker);
+	std::cerr << "Lost a worker, " << workers.size() << " left" << std::endl;
+}
+
+void RenderCoordinator::Render(Scene *renderScene, Renderer &renderer, int jobSize) {
+	scene = renderScene;
+
+	// Same ordering as the local tiles, handed out from the back
+	Tile frame = renderer.region;		// The crop window, if any
+	TileScheduler order(frame, jobSize, settings.tileOrder, 1);
+	order.reportProgress = false;
+	Tile tile;
+	while(order.NextTile(0, tile)) {
+		pendingJobs.push_back(tile);
+	}
+	std::reverse(pendingJobs.begin(), pendingJobs.end());
+	int jobCount = pendingJobs.size();
+	int jobsDone = 0;
+
+	double lastWorkerSeen = omp_get_wtime();
+	while(!pendingJobs.empty() || std::count(workerBusy.begin(), workerBusy.end(), true) > 0) {
+		for(uint w = 0; w < workers.size(); w++) {
+			if(!workerBusy[w] && !pendingJobs.empty()) {
+				if(SendJob(w, pendingJobs.back())) {
+					pendingJobs.pop_back();
+				}
+				else {
+					DropWorker(w--);
+				}
+			}
+		}
+
+		if(workers.empty()) {
+			if(omp_get_wtime() - lastWorkerSeen > WORKER_WAIT_SECONDS) {
+				std::cerr << "No workers, rendering the remaining " << pendingJobs.size() << " jobs here" << std::endl;
+				for(const Tile &job : pendingJobs) {
+					renderer.SetRegion(job);
+					renderer.RenderPass(0, scene->samplesPerPixel, scene->maxSamplesPerPixel, 1);
+				}
+				renderer.SetRegion(frame);
+				pendingJobs.clear();
+				break;
+			}
+		}
+		else {
+			lastWorkerSeen = omp_get_wtime();
+		}
+
+		std::vector<pollfd> fds(workers.size() + 1);
+		fds[0] = {listener, POLLIN, 0};
+		for(uint w = 0; w < workers.size(); w++) {
+			fds[w + 1] = {workers[w], POLLIN, 0};
+		}
+		poll(fds.data(), fds.size(), 100);
+
+		// Results first, indices shift once a worker is dropped
+		for(int w = workers.size() - 1; w >= 0; w--) {
+			if(fds[w + 1].revents == 0) {
+				// Still connected but gone quiet, a stopped process or a dead host that never closed the connection
+				if(workerBusy[w] && omp_get_wtime() - workerSent[w] > WORKER_JOB_TIMEOUT_SECONDS) {
+					std::cerr << "Worker took over " << WORKER_JOB_TIMEOUT_SECONDS << " seconds on a job" << std::endl;
+					DropWorker(w);
+				}
+				continue;
+			}
+			if(workerBusy[w] && (fds[w + 1].revents & POLLIN) && ReceiveResult(w, renderer)) {
+				jobsDone++;
+				if((jobsDone * 10) / jobCount != ((jobsDone - 1) * 10) / jobCount) {
+					std::cout << (jobsDone * 100) / jobCount << "%" << std::endl;
+				}
+			}
+			else {
+				DropWorker(w);
+			}
+		}
+		if(fds[0].revents & POLLIN) {
+			AcceptWorker();
+		}
+	}
+
+	WorkerJob done = {};
+	done.done = 1;
+	for(int worker : workers) {
+		WriteAll(worker, &done, sizeof(done));
+	}
+}
+
+bool RunWorker(Scene *scene, const RenderSettings &settings, const char *address, uint64_t renderHash) {
+	std::string hostPort = address;
+	size_t colon = hostPort.find_last_of(':');
+	if(colon == std::string::npos) {
+		std::cerr << "Worker address should be host:port" << std::endl;
+		return false;
+	}
+	std::string host = hostPort.substr(0, colon);
+	std::string port = hostPort.substr(colon + 1);
+
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *found = NULL;
+	if(getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+		std::cerr << "Unknown coordinator host: " << host << std::endl;
+		return false;
+	}
+
+	int coordinator = -1;
+	for(int attempt = 0; attempt < CONNECT_ATTEMPTS && coordinator < 0; attempt++) {
+		coordinator = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(coordinator, found->ai_addr, found->ai_addrlen) != 0) {
+			close(coordinator);
+			coordinator = -1;
+			usleep(100000);
+		}
+	}
+	freeaddrinfo(found);
+	if(coordinator < 0) {
+		std::cerr << "Could not reach the coordinator at " << address << std::endl;
+		return false;
+	}
+
+	int noDelay = 1;
+	setsockopt(coordinator, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	// An idle worker waits on the slowest job out, which the coordinator gives up on after WORKER_JOB_TIMEOUT_SECONDS
+	SetReadTimeout(coordinator, WORKER_JOB_TIMEOUT_SECONDS + WORKER_TIMEOUT_SECONDS);
+
+	WorkerHello hello = {};
+	hello.magic = WORKER_MAGIC;
+	hello.width = scene->imageWidth;
+	hello.height = scene->imageHeight;
+	hello.triangleCount = scene->triangles.size();
+	hello.sphereCount = scene->spheres.size();
+	hello.renderHash = renderHash;
+	WriteAll(coordinator, &hello, sizeof(hello));
+
+	RenderSettings workerSettings = settings;
+	workerSettings.verbose = false;
+	Renderer renderer = Renderer(scene, workerSettings);
+	std::vector<Color> colors;
+	std::vector<int> counts;
+	int jobs = 0;
+
+	WorkerJob job;
+	while(ReadAll(coordinator, &job, sizeof(job)) && !job.done) {
+		renderer.SetRegion(job.tile);
+		renderer.ClearRegion();
+		long long before = renderer.totalSamples;
+		renderer.RenderPass(0, scene->samplesPerPixel, scene->maxSamplesPerPixel, 1);
+
+		WorkerResult result;
+		result.tile = renderer.region;
+		result.samples = renderer.totalSamples - before;
+		int area = TileArea(result.tile);
+		colors.resize(area);
+		counts.resize(area);
+		renderer.ReadRegion(colors.data(), counts.data());
+
+		if(!WriteAll(coordinator, &result, sizeof(result)) || !WriteAll(coordinator, colors.data(), area * sizeof(Color)) || !WriteAll(coordinator, counts.data(), area * sizeof(int))) {
+			break;
+		}
+		jobs++;
+	}
+
+	close(coordinator);
+	std::cout << "Worker rendered " << jobs << " jobs" << std::endl;
+
+	return true;
+}
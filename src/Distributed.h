@@ -0,0 +1,76 @@
+#ifndef DISTRIBUTED_INCLUDED
+#define DISTRIBUTED_INCLUDED
+
+#include "Renderer.h"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#define DEFAULT_JOB_SIZE 64		// Pixels per side of the rectangle a worker gets at a time
+#define WORKER_MAGIC 0x52545753		// "RTWS", bump when the messages below change
+#define WORKER_TIMEOUT_SECONDS 30		// A worker that stops halfway through a message is dropped after this
+#define WORKER_JOB_TIMEOUT_SECONDS 300		// A worker that sends nothing back this long after a job is dropped and the job handed out again
+
+// Sent by a worker once it has loaded its scene, so a mismatched scene file or render option is caught up front
+struct WorkerHello {
+	uint32_t magic;
+	int32_t width, height;
+	int32_t triangleCount, sphereCount;
+	int32_t pad;
+	uint64_t renderHash;		// RenderHash of the worker's scene file and settings
+};
+
+// Coordinator to worker. Anything with done set ends the worker
+struct WorkerJob {
+	Tile tile;
+	int32_t done;
+};
+
+// Worker to coordinator, followed by the tile's colour sums and sample counts, row by row
+struct WorkerResult {
+	Tile tile;
+	int64_t samples;
+};
+
+// Splits the frame into jobs and hands them to worker processes over TCP
+// Workers load the same scene file themselves. A worker that drops out has its job handed to another one,
+// and if none are left the coordinator renders the rest itself
+class RenderCoordinator {
+public:
+	RenderCoordinator(const RenderSettings &settings);
+	~RenderCoordinator();
+
+	bool Listen(int port);		// 0 picks a free port
+	void SpawnLocalWorkers(int count, const std::vector<std::string> &workerArgs);
+	void Render(Scene *scene, Renderer &renderer, int jobSize);		// Listen first, so workers can load while we do
+
+	int port = 0;
+	uint64_t renderHash = 0;		// Workers with another hash are turned away
+
+private:
+	bool AcceptWorker();
+	bool SendJob(int worker, const Tile &tile);
+	bool ReceiveResult(int worker, Renderer &renderer);
+	void DropWorker(int worker);
+
+	Scene *scene = NULL;
+	RenderSettings settings;
+
+	int listener = -1;
+	std::vector<int> workers;			// Sockets
+	std::vector<Tile> workerJobs;		// Outstanding job per worker
+	std::vector<bool> workerBusy;
+	std::vector<double> workerSent;		// When the outstanding job went out
+	std::vector<Tile> pendingJobs;
+	std::vector<int> children;			// Local workers we started
+};
+
+// Hash of the scene file's bytes and everything the command line can change about the pixels
+// Taken once the overrides are applied to the scene
+uint64_t RenderHash(const char *sceneFile, const Scene *scene);
+
+// Connects to a coordinator, then renders whatever rectangles it sends until told to stop
+bool RunWorker(Scene *scene, const RenderSettings &settings, const char *address, uint64_t renderHash);
+
+#endif
@@ -2,6 +2,10 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION //only place once in one .cpp file
 #include "stb_image_write.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
 Image::Image(int w, int h) {
 	width = w;
 	height = h;
@@ -35,25 +39,106 @@ uint8_t* Image::ToBytes() {
 	return rawPixels;
 }
 
-void Image::Write(const char* fileName) {
+bool Image::Write(const char* fileName) {
 	uint8_t *rawBytes = ToBytes();
 
 	int lastc = strlen(fileName);
+	int ok;
 
 	switch(fileName[lastc - 1]) {
 		case 'g': // Either jpeg (or jpg) or png
 			if(fileName[lastc - 2] == 'p' || fileName[lastc - 2] == 'e') {	// jpeg or jpg
-				stbi_write_jpg(fileName, width, height, 4, rawBytes, 95);	// 95% jpeg quality
+				ok = stbi_write_jpg(fileName, width, height, 4, rawBytes, 95);	// 95% jpeg quality
 			} 
 			else {	//png
-				stbi_write_png(fileName, width, height, 4, rawBytes, width * 4);
+				ok = stbi_write_png(fileName, width, height, 4, rawBytes, width * 4);
 			}
+			break;
 		case 'a':	// tga (targa)
-			stbi_write_tga(fileName, width, height, 4, rawBytes);
+			ok = stbi_write_tga(fileName, width, height, 4, rawBytes);
+			break;
 		case 'p':	// bmp
 		default:
-			stbi_write_bmp(fileName, width, height, 4, rawBytes);
+			ok = stbi_write_bmp(fileName, width, height, 4, rawBytes);
 	}
 
 	delete[] rawBytes;
+
+	return ok != 0;
 };
+
+static uint32_t ReadLE(const uint8_t *bytes, int size) {
+	uint32_t value = 0;
+	for(int i = size - 1; i >= 0; i--) {
+		value = (value << 8) | bytes[i];
+	}
+
+	return value;
+}
+
+#define MAX_READ_PIXELS (1 << 28)		// Larger files are taken for corrupt rather than allocated
+
+// 24 and 32 bit BMPs, the kind Write produces. Bytes come back as (byte + 0.5) / 255,
+// so writing the image again gives the same bytes
+bool Image::Read(const char* fileName) {
+	FILE *file = fopen(fileName, "rb");
+	if(!file) {
+		return false;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buffer[65536];
+	size_t got;
+	while((got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data.insert(data.end(), buffer, buffer + got);
+	}
+	fclose(file);
+
+	if(data.size() < 54 || data[0] != 'B' || data[1] != 'M') {
+		return false;
+	}
+
+	uint32_t dataOffset = ReadLE(&data[10], 4);
+	uint32_t headerSize = ReadLE(&data[14], 4);
+	if(headerSize < 40 || data.size() < 14 + (size_t) headerSize) {
+		return false;
+	}
+	int w = (int32_t) ReadLE(&data[18], 4);
+	int h = (int32_t) ReadLE(&data[22], 4);
+	int bitsPerPixel = ReadLE(&data[28], 2);
+	uint32_t compression = ReadLE(&data[30], 4);
+
+	bool topDown = h < 0;
+	h = abs(h);
+	if(w <= 0 || h == 0 || (size_t) w * h > MAX_READ_PIXELS || (bitsPerPixel != 24 && bitsPerPixel != 32)) {
+		return false;
+	}
+	if(compression == 3) {		// Bitfields, only the usual BGRA layout
+		if(bitsPerPixel != 32 || headerSize < 52 || ReadLE(&data[54], 4) != 0xff0000 || ReadLE(&data[58], 4) != 0xff00 || ReadLE(&data[62], 4) != 0xff) {
+			return false;
+		}
+	}
+	else if(compression != 0) {
+		return false;
+	}
+
+	size_t rowSize = ((bitsPerPixel * (size_t) w + 31) / 32) * 4;
+	if(dataOffset + rowSize * h > data.size()) {
+		return false;
+	}
+
+	delete[] pixels;
+	width = w;
+	height = h;
+	pixels = new Color[width * height];
+
+	int bytesPerPixel = bitsPerPixel / 8;
+	for(int j = 0; j < height; j++) {
+		const uint8_t *row = &data[dataOffset + rowSize * (topDown ? j : height - 1 - j)];
+		for(int i = 0; i < width; i++) {
+			const uint8_t *p = row + i * bytesPerPixel;
+			SetPixel(i, j, Color((p[2] + 0.5f) / 255, (p[1] + 0.5f) / 255, (p[0] + 0.5f) / 255));
+		}
+	}
+
+	return true;
+}
@@ -12,7 +12,8 @@ public:
     Image(int w, int h);
     ~Image();
     void SetPixel(int i, int j, Color c);
-    void Write(const char* fileName);
+    bool Write(const char* fileName);	// False if the file could not be written
+    bool Read(const char* fileName);	// Uncompressed BMP only, resizes to the file's
 
     uint8_t *ToBytes();
     Color &GetPixel(int i, int j);
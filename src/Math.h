@@ -25,20 +25,39 @@ struct Vec3f {
 
 	float Normalize();
 	void Negate();
-	Vec3f Cross(const Vec3f &v2) const;
-	float Dot(const Vec3f &v2) const;
+
+	// These sit in every intersection test, so keep them inline
+
+	Vec3f Cross(const Vec3f &v2) const {
+		return Vec3f(	y*v2.z - z*v2.y,
+						z*v2.x - x*v2.z,
+						x*v2.y - y*v2.x	);
+	}
+
+	float Dot(const Vec3f &v2) const {
+		return x*v2.x + y*v2.y + z*v2.z;
+	}
 
 	float x = 0.f;
 	float y = 0.f;
 	float z = 0.f;
 
-	Vec3f operator+(const Vec3f &v2) const;
-	Vec3f operator-(const Vec3f &v2) const;
+	Vec3f operator+(const Vec3f &v2) const {
+		return Vec3f(x + v2.x, y + v2.y, z + v2.z);
+	}
+
+	Vec3f operator-(const Vec3f &v2) const {
+		return Vec3f(x - v2.x, y - v2.y, z - v2.z);
+	}
 
 	// We want symmetry for these operators
 
-	friend Vec3f operator*(float lhs, const Vec3f &rhs);
-	friend Vec3f operator*(const Vec3f &lhs, float rhs);
+	friend Vec3f operator*(float lhs, const Vec3f &rhs) {
+		return Vec3f(lhs * rhs.x, lhs * rhs.y, lhs * rhs.z);
+	}
+	friend Vec3f operator*(const Vec3f &lhs, float rhs) {
+		return Vec3f(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs);
+	}
 	friend Vec3f operator/(float lhs, const Vec3f &rhs);
 	friend Vec3f operator/(const Vec3f &lhs, float rhs);
 };
@@ -53,7 +72,7 @@ struct Quaternion {
 
 	Quaternion(const Vec3f &axis, float angle); // Create from an axis-angle
 
-	Quaternion GetConjugate();
+	Quaternion GetConjugate() const;
 	void Normalize();
 	Vec3f RotateVector(const Vec3f &v) const;
 
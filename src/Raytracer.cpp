@@ -1,5 +1,8 @@
 #include "Raytracer.h"
-#include "Image.h"
+#include "Renderer.h"
+#include "Batch.h"
+#include "RenderServer.h"
+#include "Distributed.h"
 #include "Math.h"
 #include "scene/SceneLoader.h"
 
@@ -7,8 +10,8 @@
 
 #include <iostream>
 #include <algorithm>
-
-#define SAMPLE_COUNT 1
+#include <cstdlib>
+#include <vector>
 
 // Fall-off constants 
 #define KC 2
@@ -28,7 +31,7 @@ Vec3f RayPlaneIntersection(Vec3f start, Vec3f dir, Plane plane, float &d) {
 
 // Boolean hit check against triangle,
 // Passes a Vec3f intersection point
-bool HitCheckTriangle(Vec3f start, Vec3f dir, Triangle triangle, float tMax, float &tHit, float &u, float &v) {
+bool HitCheckTriangle(Vec3f start, Vec3f dir, const Triangle &triangle, float tMax, float &tHit, float &u, float &v) {
 
 	// Möller-Trumbore test
 	Vec3f e1 = triangle.v2 - triangle.v1;
@@ -65,6 +68,25 @@ bool HitCheckTriangle(Vec3f start, Vec3f dir, Triangle triangle, float tMax, flo
 	return true;
 }
 
+// Shading normal at barycentrics (u, v), interpolated if the triangle has normals
+// Flat normals get flipped to face start
+Vec3f TriangleNormal(const Triangle &triangle, Vec3f start, float u, float v) {
+	Vec3f n;
+
+	if(triangle.useNormals) {
+		n = ((1 - u - v) * triangle.n1) + (u * triangle.n2) + (v * triangle.n3);
+		n.Normalize();
+	}
+	else {
+		n = triangle.plane.normal;	// Triangle normal
+		if((n.Dot(start) - triangle.plane.dist) < 0) {			// Flip if facing away from ray
+			n.Negate();
+		}
+	}
+
+	return n;
+}
+
 // Returns a boolean hit check,
 // Passes the t value where a strike occurs
 bool HitCheckSphere(Vec3f start, Vec3f dir, float tMax, Vec3f spherePos, float r, float &tHit) {
@@ -93,20 +115,17 @@ bool HitCheckSphere(Vec3f start, Vec3f dir, float tMax, Vec3f spherePos, float r
 	return false;
 }
 
+// Shadow test, any blocker in [RAY_EPS, tMax] will do
 bool HitCheckScene(Vec3f start, Vec3f dir, float tMax, Scene *scene) {
 	float tHit = tMax;
 
 	if(scene->accelerate && scene->hasBvh) {
-		Triangle hitTriangle;
-		float u, v;
-		if(scene->bvh->RayBvh(start, dir, 0, tMax, tHit, hitTriangle, u, v)) {
-			if(!(tHit < RAY_EPS)) {
-				return true;
-			}
+		if(scene->bvh->OccludedBvh(start, dir, tMax)) {
+			return true;
 		}
 	}
 	else {
-		for(Triangle triangle : scene->triangles) {
+		for(const Triangle &triangle : scene->triangles) {
 			float u, v;
 			if(HitCheckTriangle(start, dir, triangle, tMax, tHit, u, v)) {
 				if(!(tHit < RAY_EPS)) {
@@ -116,7 +135,15 @@ bool HitCheckScene(Vec3f start, Vec3f dir, float tMax, Scene *scene) {
 		}
 	}
 
-	for(Sphere sphere : scene->spheres) {
+	if(scene->hasInstanceBvh && scene->instanceBvh->OccludedInstanceBvh(start, dir, tMax)) {
+		return true;
+	}
+
+	if(scene->accelerate && scene->hasSphereBvh) {
+		return scene->sphereBvh->OccludedSphereBvh(start, dir, tMax);
+	}
+
+	for(const Sphere &sphere : scene->spheres) {
 		if(HitCheckSphere(start, dir, tMax, sphere.origin, sphere.r, tHit)) {
 			if(!(tHit < RAY_EPS)) {
 				return true;
@@ -145,253 +172,701 @@ float GetFresnelFactor(float refractionCoeff1, float refractionCoeff2, Vec3f v,
 	return fresnelFactor;
 }
 
-Color Shade(Vec3f v, Vec3f n, Vec3f p, Material material, Scene *scene, bool noRefract, int depth) {
-	Color shade = scene->ambient * material.ambient;
+// Lights are numbered directional first, then point lights
+int LightCount(const Scene *scene) {
+	return scene->directionalLights.size() + scene->pointLights.size();
+}
 
-	for(DirectionalLight directionalLight : scene->directionalLights) {
-		Vec3f lightDir = directionalLight.direction;
+// Shadow ray from p towards a light. False when the surface faces away and the light can't reach it anyway
+bool LightRay(int light, Vec3f n, Vec3f p, Scene *scene, Vec3f &toLight, float &tMax) {
+	if(light < (int) scene->directionalLights.size()) {
+		Vec3f lightDir = scene->directionalLights[light].direction;
 		lightDir.Normalize();
-		Vec3f toLight = lightDir;
+		toLight = lightDir;
+		toLight.Negate();
+		tMax = MAX_T;
+	}
+	else {
+		Vec3f lightDir = p - scene->pointLights[light - scene->directionalLights.size()].origin;
+		tMax = lightDir.Normalize();
+		toLight = lightDir;
 		toLight.Negate();
-			
-		if((n.Dot(toLight) > PLANE_EQUALS_EPS) && !HitCheckScene(p, toLight, MAX_T, scene)) {		// Cast another ray for shadowing
-			float diffuse = std::clamp(n.Dot(toLight), 0.f, 1.f);
-		
-			Vec3f rayReflected = ((2 * lightDir.Dot(n)) * n) - lightDir;
-			float specular = std::clamp(rayReflected.Dot(v), 0.f, 1.f);
-			specular = powf(specular, material.specularCoeff);
-
-			shade = shade + (directionalLight.intensity * material.diffuse * diffuse) + (directionalLight.intensity * material.specular * specular); 
-		}
 	}
 
-	for(PointLight pointLight : scene->pointLights) {
-		Vec3f lightDir = p - pointLight.origin;
-		float dist = lightDir.Normalize();
+	return n.Dot(toLight) > PLANE_EQUALS_EPS;
+}
+
+// shade plus what a light adds to a point it can see
+Color AddLight(Color shade, int light, Vec3f v, Vec3f n, Vec3f p, const Material &material, Scene *scene) {
+	if(light < (int) scene->directionalLights.size()) {
+		const DirectionalLight &directionalLight = scene->directionalLights[light];
+		Vec3f lightDir = directionalLight.direction;
+		lightDir.Normalize();
 		Vec3f toLight = lightDir;
 		toLight.Negate();
-		
-		if((n.Dot(toLight) > PLANE_EQUALS_EPS) && !HitCheckScene(p, toLight, dist, scene)) {		// Cast another ray for shadowing
-			float diffuse = std::clamp(n.Dot(toLight), 0.f, 1.f);
-			
-			Vec3f rayReflected = ((2 * lightDir.Dot(n)) * n) - lightDir;
-			float specular = powf(std::clamp(rayReflected.Dot(v), 0.f, 1.f), material.specularCoeff);
-			specular = powf(specular, material.specularCoeff);
 
-			float falloff = 1 / (KC + KL * dist + KQ * (dist * dist));
-			shade = shade + falloff * (material.diffuse * pointLight.intensity * diffuse + material.specular * pointLight.intensity * specular);
-		}
+		float diffuse = std::clamp(n.Dot(toLight), 0.f, 1.f);
+
+		Vec3f rayReflected = ((2 * lightDir.Dot(n)) * n) - lightDir;
+		float specular = std::clamp(rayReflected.Dot(v), 0.f, 1.f);
+		specular = powf(specular, material.specularCoeff);
+
+		return shade + (directionalLight.intensity * material.diffuse * diffuse) + (directionalLight.intensity * material.specular * specular);
 	}
 
-	if(!(depth > scene->maxDepth)) {
-		float fresnelFactor;
+	const PointLight &pointLight = scene->pointLights[light - scene->directionalLights.size()];
+	Vec3f lightDir = p - pointLight.origin;
+	float dist = lightDir.Normalize();
+	Vec3f toLight = lightDir;
+	toLight.Negate();
 
-		if(n.Dot(v) > 0) {	// In a dielectric
-			fresnelFactor = GetFresnelFactor(material.refractionCoeff, 1, v, n);
-		} 
-		else {			// In air
-			fresnelFactor = GetFresnelFactor(1, material.refractionCoeff, v, n);
-		}
+	float diffuse = std::clamp(n.Dot(toLight), 0.f, 1.f);
 
-		if(!(material.specular.Length() < 0.001)) {
-			Vec3f rayReflected = (-2 * v.Dot(n) * n) + v;
-			Color reflection = material.specular * RayTraceScene(p, rayReflected, scene, depth + 1);
-			shade = shade + reflection;
-		}
+	Vec3f rayReflected = ((2 * lightDir.Dot(n)) * n) - lightDir;
+	float specular = powf(std::clamp(rayReflected.Dot(v), 0.f, 1.f), material.specularCoeff);
+	specular = powf(specular, material.specularCoeff);
 
+	float falloff = 1 / (KC + KL * dist + KQ * (dist * dist));
+	return shade + falloff * (material.diffuse * pointLight.intensity * diffuse + material.specular * pointLight.intensity * specular);
+}
 
-		if((!(fresnelFactor == 1.f)) && !(material.transmissive.Length() < 0.001)) {	// Make sure the ray is not being hyper-reflected	
-				Vec3f rayRefracted;
-				Vec3f refractedPerp = (material.refractionCoeff) * (v + -v.Dot(n) * n);
-				Vec3f refractedParallel = sqrtf(fabs(1.0 - refractedPerp.Dot(refractedPerp))) * n;
-				refractedParallel.Negate();
-				rayRefracted = refractedPerp + refractedParallel;
-				Color refraction = (1 - fresnelFactor) * RayTraceScene(p, rayRefracted, scene, depth + 1);
+// Ambient plus every light the point can see. Reflection and refraction are left to RayTraceScene
+Color ShadeDirect(Vec3f v, Vec3f n, Vec3f p, const Material &material, Scene *scene) {
+	Color shade = scene->ambient * material.ambient;
 
-				shade = shade + (material.transmissive * refraction);
+	for(int light = 0; light < LightCount(scene); light++) {
+		Vec3f toLight;
+		float tMax;
+		if(LightRay(light, n, p, scene, toLight, tMax) && !HitCheckScene(p, toLight, tMax, scene)) {		// Cast another ray for shadowing
+			shade = AddLight(shade, light, v, n, p, material, scene);
 		}
-
 	}
 
-	shade = Color(std::clamp(shade.r, 0.f, 1.f), std::clamp(shade.g, 0.f, 1.f), std::clamp(shade.b, 0.f, 1.f)); 
-
 	return shade;
 }
 
-Color RayTraceScene(Vec3f start, Vec3f dir, Scene *scene, int depth) {
-	bool noRefract;
+// Closest hit along the ray, with v (eye to hit) and n normalized for shading
+bool ClosestHit(Vec3f start, Vec3f dir, Scene *scene, Vec3f &v, Vec3f &n, Vec3f &p, Material &material, const TriangleHit *knownHit) {
 	float tMax = MAX_T;
 	bool hit = false;
-	Vec3f v, n, p;			// For shading
-	Material material;	// Material, also for shading
 	float tHit = tMax;
 
 	if(scene->accelerate && scene->hasBvh) {
-		Triangle hitTriangle;
+		uint hitIdx;
 		float uCoord, vCoord;
-		if(scene->bvh->RayBvh(start, dir, 0, tMax, tHit, hitTriangle, uCoord, vCoord)) {
+		bool triangleHit;
+		if(knownHit) {		// Already traced as part of a packet
+			triangleHit = knownHit->triangle >= 0;
+			if(triangleHit) {
+				tHit = knownHit->t;
+				hitIdx = knownHit->triangle;
+				uCoord = knownHit->u;
+				vCoord = knownHit->v;
+			}
+		}
+		else {
+			triangleHit = scene->bvh->RayBvh(start, dir, tMax, tHit, hitIdx, uCoord, vCoord);
+		}
+		if(triangleHit) {
+			const Triangle &hitTriangle = scene->bvh->triangles[hitIdx];		// Only now touch normals and material
 			if(!(tHit < RAY_EPS)) {
 				v = tHit * dir;					// Vector from eye to hit point
 				p = start + v;					// Hit point
-				if(hitTriangle.useNormals) {
-					n = (uCoord * hitTriangle.n1) + (vCoord * hitTriangle.n2) + ((1 - uCoord - vCoord) * hitTriangle.n3);
-					n.Normalize();
-				}
-				else {
-					n = hitTriangle.plane.normal;	// Triangle normal
-					if((n.Dot(start) - hitTriangle.plane.dist) < 0) {			// Flip if facing away from ray
-						n.Negate();
-					}
-				}
+				n = TriangleNormal(hitTriangle, start, uCoord, vCoord);
 				material = hitTriangle.material;
 
 				tMax = tHit;
 				hit = true;
-				noRefract = true;
 			}
 		}
 
 	}
 	else {
-		for(Triangle triangle : scene->triangles) {
+		for(const Triangle &triangle : scene->triangles) {
 			float uCoord, vCoord;
 			if(HitCheckTriangle(start, dir, triangle, tMax, tHit, uCoord, vCoord)) {
 				if(tHit > RAY_EPS) {
 					v = tHit * dir;				// Vector from eye to hit point
 					p = start + v;				// Hit point
-
-					if(triangle.useNormals) {
-						n = ((1 - uCoord - vCoord) * triangle.n1) + (uCoord * triangle.n2) + (vCoord * triangle.n3);
-						n.Normalize();
-						//return Color(n.x, n.y, n.z);
-					}
-					else {
-						n = triangle.plane.normal;	// Triangle normal
-						if((n.Dot(start) - triangle.plane.dist) < 0) {			// Flip if facing away from ray
-							n.Negate();
-						}
-					}
-
+					n = TriangleNormal(triangle, start, uCoord, vCoord);
 					material = triangle.material;
 
 					tMax = tHit;
 					hit = true;
-					noRefract = true;
 				}
 			}
 		}
 
 	}
 
+	if(scene->hasInstanceBvh) {
+		uint instanceIdx, hitIdx;
+		float uCoord, vCoord;
+		if(scene->instanceBvh->RayInstanceBvh(start, dir, tMax, tHit, instanceIdx, hitIdx, uCoord, vCoord)) {		// Bounded by the triangle hit
+			const Instance &instance = scene->instanceBvh->instances[instanceIdx];
+			const Triangle &hitTriangle = scene->meshes[instance.meshIdx].bvh->triangles[hitIdx];
+			v = tHit * dir;					// Vector from eye to hit point
+			p = start + v;					// Hit point
+			n = instance.ToWorldNormal(TriangleNormal(hitTriangle, instance.ToLocalPoint(start), uCoord, vCoord));		// Shaded in object space
+			material = hitTriangle.material;
+
+			tMax = tHit;
+			hit = true;
+		}
+	}
 
-	for(Sphere sphere : scene->spheres) {
-		if(HitCheckSphere(start, dir, tMax, sphere.origin, sphere.r, tHit)) {
-			if(!(tHit < RAY_EPS)) {
-				v = tHit * dir;				// Vector from eye to hit point
-				p = start + v;				// Point on sphere
-				n = p - sphere.origin;		// Surface normal
-				material = sphere.material;
+	if(scene->accelerate && scene->hasSphereBvh) {
+		uint sphereIdx;
+		if(scene->sphereBvh->RaySphereBvh(start, dir, tMax, tHit, sphereIdx)) {		// Bounded by the triangle hit
+			const Sphere &sphere = scene->sphereBvh->spheres[sphereIdx];
+			v = tHit * dir;				// Vector from eye to hit point
+			p = start + v;				// Point on sphere
+			n = p - sphere.origin;		// Surface normal
+			material = sphere.material;
+
+			tMax = tHit;
+			hit = true;
+		}
+	}
+	else {
+		for(const Sphere &sphere : scene->spheres) {
+			if(HitCheckSphere(start, dir, tMax, sphere.origin, sphere.r, tHit)) {
+				if(!(tHit < RAY_EPS)) {
+					v = tHit * dir;				// Vector from eye to hit point
+					p = start + v;				// Point on sphere
+					n = p - sphere.origin;		// Surface normal
+					material = sphere.material;
 
-				tMax = tHit;	// Truncate the ray. This helps with performance
-				hit = true;
-				noRefract = false;
+					tMax = tHit;	// Truncate the ray. This helps with performance
+					hit = true;
+				}
 			}
 		}
 	}
 
 	if(!hit) {
-		return scene->background;
+		return false;
 	}
 
-	// Since we got the closest hit data, we can now shade
-	
 	n.Normalize();
 	v.Normalize();
-	Color c = Shade(v, n, p, material, scene, noRefract, depth);
 
-	//std::cout << c.r << " " << c.g << " "  << c.b << std::endl;
+	return true;
+}
 
-	return c;	// Costly, so it's good to do once per ray
+// Triangle hits of a packet of camera rays, for ClosestHit to pick up one by one
+// Only with the scene BVH, instances and spheres are still traced per ray
+void TracePrimaryPacket(const RayPacket &packet, Scene *scene, TriangleHit *hits) {
+	scene->bvh->RayPacketBvh(packet, MAX_T, hits);
 }
 
-// Returns time taken for the process
-// Accelerated with OpenMP
-double RayTracePixel(int i, int j, Camera camera, int imgW, int imgH, double halfW, double halfH, float d, Scene *raytracerScene, Image *outputImage) {
-	Color color = Color(0, 0, 0);
-	int samples;
-	double start = omp_get_wtime();
-	//#pragma omp parallel for schedule(static, 1) num_threads(SAMPLE_COUNT)
-	for(samples = 0; samples < SAMPLE_COUNT; samples++) {		// Do a few samples to beat aliasing
-		float u = (halfW - imgW * (i / ((double) imgW)));
-		float v = (halfH - imgH * (j / ((double) imgH)));
-		Vec3f p = camera.eye - d * camera.fwd + u * camera.right + v * camera.up;
-		Vec3f rayDir = (p - camera.eye);
-		rayDir.Normalize();
+// One ray on RayTraceScene's work list. It waits on at most one child at a time
+struct RayTask {
+	Vec3f start, dir;
+	int depth;
+	Color weight;		// Product of the scales between this ray and the pixel
+	int stage;
+
+	Vec3f v, n, p;
+	Material material;
+	float fresnelFactor;
+	Color shade;
+};
+
+enum RayStage {
+	RAY_TRACE,			// Not intersected yet
+	RAY_REFLECT,		// Shaded directly, reflection next
+	RAY_REFRACT,		// Reflection done or skipped, refraction next
+	RAY_DONE
+};
+
+// Scales can go negative, the Fresnel factor overshoots 1 inside a dielectric
+static float MaxMagnitude(const Color &c) {
+	return std::max(fabsf(c.r), std::max(fabsf(c.g), fabsf(c.b)));
+}
+
+static RayTask NewRayTask(Vec3f start, Vec3f dir, int depth, const Color &weight) {
+	RayTask task;
+	task.start = start;
+	task.dir = dir;
+	task.depth = depth;
+	task.weight = weight;
+	task.stage = RAY_TRACE;
+
+	return task;
+}
 
-		color = color + RayTraceScene(camera.eye, rayDir, raytracerScene, 1);
+float HitFresnelFactor(Vec3f v, Vec3f n, const Material &material) {
+	if(n.Dot(v) > 0) {	// In a dielectric
+		return GetFresnelFactor(material.refractionCoeff, 1, v, n);
 	}
-	double end = omp_get_wtime();
-	
-	color = color / SAMPLE_COUNT;
 
-	(*outputImage).SetPixel(i, j, color);
+	return GetFresnelFactor(1, material.refractionCoeff, v, n);		// In air
+}
 
-	double time = end - start;
-	//std::cout << time << std::endl;
-	return time;
+// Reflection off a hit, unless it is too faint to matter. childWeight is what it reaches the pixel with
+bool ReflectedRay(Vec3f v, Vec3f n, const Material &material, const Color &weight, Scene *scene, Vec3f &dir, Color &childWeight) {
+	Color specular = material.specular;
+	childWeight = weight * specular;
+	if(specular.Length() < 0.001 || MaxMagnitude(childWeight) < scene->minRayWeight) {
+		return false;
+	}
+
+	dir = (-2 * v.Dot(n) * n) + v;
+
+	return true;
+}
+
+// Refraction through a hit, unless it is too faint to matter or totally reflected
+bool RefractedRay(Vec3f v, Vec3f n, const Material &material, float fresnelFactor, const Color &weight, Scene *scene, Vec3f &dir, Color &childWeight) {
+	Color transmissive = material.transmissive;
+	childWeight = weight * ((1 - fresnelFactor) * transmissive);
+	if(fresnelFactor == 1.f || transmissive.Length() < 0.001 || MaxMagnitude(childWeight) < scene->minRayWeight) {
+		return false;
+	}
+
+	Vec3f refractedPerp = (material.refractionCoeff) * (v + -v.Dot(n) * n);
+	Vec3f refractedParallel = sqrtf(fabs(1.0 - refractedPerp.Dot(refractedPerp))) * n;
+	refractedParallel.Negate();
+	dir = refractedPerp + refractedParallel;
+
+	return true;
+}
+
+Color ClampColor(const Color &c) {
+	return Color(std::clamp(c.r, 0.f, 1.f), std::clamp(c.g, 0.f, 1.f), std::clamp(c.b, 0.f, 1.f));
+}
+
+// Whitted tracing without recursion: reflection and refraction rays go on an explicit stack,
+// each carrying the weight it reaches the pixel with. Every ray's colour is clamped to [0, 1],
+// so a ray whose weight is below scene->minRayWeight can change the pixel by at most that and is dropped.
+// With minRayWeight 0 the result is the same as the old recursive Shade
+// primaryHit is the first ray's triangle hit when a packet already found it
+Color RayTraceScene(Vec3f start, Vec3f dir, Scene *scene, int depth, const TriangleHit *primaryHit) {
+	static thread_local std::vector<RayTask> stack;		// Reused, rays don't allocate
+	stack.clear();
+	stack.push_back(NewRayTask(start, dir, depth, Color(1, 1, 1)));
+
+	Color result;
+	bool returning = false;		// result holds the colour of the ray just popped
+	while(true) {
+		RayTask &task = stack.back();
+		bool missed = false;
+
+		if(returning) {
+			if(task.stage == RAY_REFRACT) {
+				task.shade = task.shade + task.material.specular * result;
+			}
+			else {
+				Color refraction = (1 - task.fresnelFactor) * result;
+				task.shade = task.shade + (task.material.transmissive * refraction);
+			}
+			returning = false;
+		}
+
+		if(task.stage == RAY_TRACE) {
+			const TriangleHit *knownHit = (stack.size() == 1) ? primaryHit : NULL;
+			if(!ClosestHit(task.start, task.dir, scene, task.v, task.n, task.p, task.material, knownHit)) {
+				result = scene->background;
+				missed = true;
+				task.stage = RAY_DONE;
+			}
+			else {
+				task.shade = ShadeDirect(task.v, task.n, task.p, task.material, scene);
+				task.stage = (task.depth > scene->maxDepth) ? RAY_DONE : RAY_REFLECT;
+				task.fresnelFactor = HitFresnelFactor(task.v, task.n, task.material);
+			}
+		}
+
+		if(task.stage == RAY_REFLECT) {
+			task.stage = RAY_REFRACT;
+			Vec3f rayReflected;
+			Color childWeight;
+			if(ReflectedRay(task.v, task.n, task.material, task.weight, scene, rayReflected, childWeight)) {
+				stack.push_back(NewRayTask(task.p, rayReflected, task.depth + 1, childWeight));		// task is stale from here
+				continue;
+			}
+		}
+
+		if(task.stage == RAY_REFRACT) {
+			task.stage = RAY_DONE;
+			Vec3f rayRefracted;
+			Color childWeight;
+			if(RefractedRay(task.v, task.n, task.material, task.fresnelFactor, task.weight, scene, rayRefracted, childWeight)) {
+				stack.push_back(NewRayTask(task.p, rayRefracted, task.depth + 1, childWeight));
+				continue;
+			}
+		}
+
+		// Finished, hand the colour to the parent
+		if(!missed) {
+			result = ClampColor(task.shade);
+		}
+		stack.pop_back();
+		if(stack.empty()) {
+			return result;
+		}
+		returning = true;
+	}
 }
 
 int main(int argc, char** argv) {
 	if(argc < 2) {
-		std::cerr << "Usage: ./a.out scenefile" << std::endl;
+		std::cerr << "Usage: ./a.out scenefile [-accelerate [-wide] [-packets]] [-wavefront [-sort-rays]] [-bvh-cache dir] [-spp n] [-adaptive max [-adaptive-threshold t]] [-min-ray-weight w] [-progressive passes | -time-budget s] [-flush-interval s] [-batch file [-batch-jobs n] | -serve | -serve-socket path] [-coordinator port [-workers n] [-job-size n] | -worker host:port] [-checkpoint file] [-checkpoint-interval s] [-resume] [-crop x0 y0 x1 y1 [-crop-base file]] [-threads n] [-tile-size n] [-tile-order scanline|morton|spiral]" << std::endl;
 		return 0;
 	}
 
+	double programStart = omp_get_wtime();
 	const char *fileName = argv[1];
+	bool accelerate = false;
+	bool wide = false;
+	RenderSettings settings;
+	settings.threadCount = omp_get_max_threads();		// Hardware threads unless OMP_NUM_THREADS says otherwise
+	int samplesPerPixel = 0;		// 0 keeps the scene's setting
+	int maxSamplesPerPixel = 0;
+	float adaptiveThreshold = 0.f;
+	float minRayWeight = -1.f;		// Negative keeps the scene's setting
+	const char *batchFile = NULL;
+	int batchJobs = 1;
+	bool serve = false;
+	const char *serveSocket = NULL;
+	int coordinatorPort = -1;		// -1 renders here, 0 picks a free port
+	int localWorkers = 0;
+	int jobSize = DEFAULT_JOB_SIZE;
+	const char *workerAddress = NULL;
+	std::string checkpointPath;		// Empty with none of the checkpoint options
+	double checkpointInterval = CHECKPOINT_INTERVAL;
+	bool checkpoint = false;
+	bool resume = false;
+	Tile crop = {0, 0, 0, 0};		// Empty keeps the scene's crop_window
+	const char *cropBase = NULL;
 	SceneLoader loader;
+	for(int arg = 2; arg < argc; arg++) {
+		std::string option = argv[arg];
+		if(option == "-accelerate") {
+			accelerate = true;
+		}
+		else if(option == "-wide") {
+			wide = true;
+		}
+		else if(option == "-packets") {
+			settings.packets = true;
+		}
+		else if(option == "-wavefront") {
+			settings.wavefront = true;
+		}
+		else if(option == "-sort-rays") {
+			settings.sortRays = true;
+		}
+		else if(option == "-bvh-cache" && arg + 1 < argc) {
+			loader.bvhCacheDir = argv[++arg];
+		}
+		else if(option == "-threads" && arg + 1 < argc) {
+			settings.threadCount = std::max(atoi(argv[++arg]), 1);
+		}
+		else if(option == "-spp" && arg + 1 < argc) {
+			samplesPerPixel = std::max(atoi(argv[++arg]), 1);
+		}
+		else if(option == "-adaptive" && arg + 1 < argc) {
+			maxSamplesPerPixel = std::max(atoi(argv[++arg]), 1);
+		}
+		else if(option == "-adaptive-threshold" && arg + 1 < argc) {
+			adaptiveThreshold = atof(argv[++arg]);
+		}
+		else if(option == "-min-ray-weight" && arg + 1 < argc) {
+			minRayWeight = std::max(atof(argv[++arg]), 0.0);
+		}
+		else if(option == "-progressive" && arg + 1 < argc) {
+			settings.progressive = true;
+			settings.passes = std::max(atoi(argv[++arg]), 1);
+		}
+		else if((option == "-time-budget" || option == "--time-budget") && arg + 1 < argc) {
+			settings.timeBudget = atof(argv[++arg]);
+		}
+		else if(option == "-flush-interval" && arg + 1 < argc) {
+			settings.flushInterval = atof(argv[++arg]);
+		}
+		else if(option == "-batch" && arg + 1 < argc) {
+			batchFile = argv[++arg];
+		}
+		else if(option == "-batch-jobs" && arg + 1 < argc) {
+			batchJobs = std::max(atoi(argv[++arg]), 1);
+		}
+		else if(option == "-serve") {
+			serve = true;
+		}
+		else if(option == "-serve-socket" && arg + 1 < argc) {
+			serveSocket = argv[++arg];
+		}
+		else if(option == "-coordinator" && arg + 1 < argc) {
+			coordinatorPort = std::max(atoi(argv[++arg]), 0);
+		}
+		else if(option == "-workers" && arg + 1 < argc) {
+			localWorkers = std::max(atoi(argv[++arg]), 0);
+		}
+		else if(option == "-job-size" && arg + 1 < argc) {
+			jobSize = std::max(atoi(argv[++arg]), 1);
+		}
+		else if(option == "-worker" && arg + 1 < argc) {
+			workerAddress = argv[++arg];
+		}
+		else if(option == "-checkpoint" && arg + 1 < argc) {
+			checkpoint = true;
+			checkpointPath = argv[++arg];
+		}
+		else if(option == "-checkpoint-interval" && arg + 1 < argc) {
+			checkpoint = true;
+			checkpointInterval = std::max(atof(argv[++arg]), 0.0);
+		}
+		else if(option == "-resume" || option == "--resume") {
+			checkpoint = true;
+			resume = true;
+		}
+		else if(option == "-crop" && arg + 4 < argc) {
+			crop.x0 = atoi(argv[++arg]);
+			crop.y0 = atoi(argv[++arg]);
+			crop.x1 = atoi(argv[++arg]);
+			crop.y1 = atoi(argv[++arg]);
+		}
+		else if(option == "-crop-base" && arg + 1 < argc) {
+			cropBase = argv[++arg];
+		}
+		else if(option == "-tile-size" && arg + 1 < argc) {
+			settings.tileSize = std::max(atoi(argv[++arg]), 1);
+		}
+		else if(option == "-tile-order" && arg + 1 < argc) {
+			std::string order = argv[++arg];
+			if(order == "scanline") {
+				settings.tileOrder = TILE_ORDER_SCANLINE;
+			}
+			else if(order == "morton") {
+				settings.tileOrder = TILE_ORDER_MORTON;
+			}
+			else if(order == "spiral") {
+				settings.tileOrder = TILE_ORDER_SPIRAL;
+			}
+			else {
+				std::cerr << "Unknown tile order: " << order << std::endl;
+			}
+		}
+		else {
+			std::cerr << "Unknown option: " << option << std::endl;
+		}
+	}
+
+	// Those render through their own paths, which would never hand the coordinator a frame or reap its workers
+	if(coordinatorPort >= 0 && (serve || serveSocket != NULL || batchFile != NULL || workerAddress != NULL)) {
+		std::cerr << "-coordinator can't be combined with -serve, -serve-socket, -batch or -worker" << std::endl;
+		return 1;
+	}
+
+	// Local workers start loading the scene alongside us
+	RenderCoordinator *coordinator = NULL;
+	if(coordinatorPort >= 0) {
+		coordinator = new RenderCoordinator(settings);
+		if(!coordinator->Listen(coordinatorPort)) {
+			delete coordinator;
+			return 1;
+		}
+
+		if(localWorkers > 0) {
+			std::vector<std::string> workerArgs = {argv[0], argv[1]};		// Everything but the coordinator's own options and thread count
+			for(int arg = 2; arg < argc; arg++) {
+				std::string option = argv[arg];
+				if(option == "-coordinator" || option == "-workers" || option == "-job-size" || option == "-threads") {
+					arg++;
+				}
+				else {
+					workerArgs.push_back(option);
+				}
+			}
+			workerArgs.push_back("-threads");
+			workerArgs.push_back(std::to_string(std::max(settings.threadCount / localWorkers, 1)));
+
+			coordinator->SpawnLocalWorkers(localWorkers, workerArgs);
+		}
+	}
+
+	if(serve && serveSocket == NULL) {
+		std::cout.rdbuf(std::cerr.rdbuf());		// Replies own stdout, the log moves to stderr
+	}
+
 	Scene *raytracerScene = loader.ParseSceneFile(fileName);
 
 	std::cout << "--- RAYTRACING SCENE ---" << std::endl;
 
-	if(argv[2]) {
-		std::string optimize = argv[2];
-		if(optimize == "-accelerate") {
-			std::cout << "Using triangle BVH" << std::endl;
-			raytracerScene->accelerate = true;
+	if(accelerate) {
+		std::cout << "Using triangle and sphere BVHs" << std::endl;
+		raytracerScene->accelerate = true;
+	}
+
+	if(wide && raytracerScene->accelerate && raytracerScene->hasBvh) {
+		raytracerScene->bvh->CollapseWide();
+		std::cout << "Using " << WIDE_BVH_WIDTH << "-wide BVH (" << raytracerScene->bvh->wideNodesUsed << " nodes)" << std::endl;
+	}
+	if(settings.packets && raytracerScene->accelerate && raytracerScene->hasBvh) {
+		std::cout << "Tracing camera rays in " << RAY_PACKET_SIDE << "x" << RAY_PACKET_SIDE << " packets" << std::endl;
+	}
+	if(wide) {
+		for(Mesh &mesh : raytracerScene->meshes) {
+			if(mesh.bvh->bvhNodes != NULL) {
+				mesh.bvh->CollapseWide();
+			}
 		}
 	}
 
 
-	Camera camera = raytracerScene->camera;
+	if(samplesPerPixel > 0) {
+		raytracerScene->samplesPerPixel = samplesPerPixel;
+	}
+	if(maxSamplesPerPixel > 0) {
+		raytracerScene->maxSamplesPerPixel = maxSamplesPerPixel;
+	}
+	if(adaptiveThreshold > 0.f) {
+		raytracerScene->adaptiveThreshold = adaptiveThreshold;
+	}
+	if(minRayWeight >= 0.f) {
+		raytracerScene->minRayWeight = minRayWeight;
+	}
+	int sampleCount = raytracerScene->samplesPerPixel;
+	int maxSampleCount = raytracerScene->maxSamplesPerPixel;
+	if(maxSampleCount > sampleCount) {
+		std::cout << "Adaptive samples per pixel: " << sampleCount << " to " << maxSampleCount << ", threshold " << raytracerScene->adaptiveThreshold << std::endl;
+	}
+	else {
+		std::cout << "Samples per pixel: " << sampleCount << std::endl;
+	}
+
+	if(settings.timeBudget > 0) {
+		settings.timeBudget = std::max(settings.timeBudget - (omp_get_wtime() - programStart), 0.001);		// Loading counts against the deadline
+		std::cout << "Time budget: " << settings.timeBudget << " seconds left to render, uniform sampling only" << std::endl;
+	}
+	else if(settings.progressive) {
+		std::cout << "Progressive: " << settings.passes << " passes, flushing every " << settings.flushInterval << " seconds" << std::endl;
+	}
+	if(settings.wavefront && (maxSampleCount > sampleCount || checkpoint)) {
+		std::cerr << "-wavefront needs uniform sampling and no checkpoints, rendering by tiles" << std::endl;
+		settings.wavefront = false;
+	}
+	if(settings.sortRays && !settings.wavefront) {
+		std::cerr << "-sort-rays needs the ray queues of -wavefront, ignoring it" << std::endl;
+		settings.sortRays = false;
+	}
+	if(settings.wavefront) {
+		std::cout << "Rendering wavefronts on " << settings.threadCount << " threads" << (settings.sortRays ? ", secondary rays sorted" : "") << std::endl;
+	}
+	else {
+		std::cout << "Rendering tiles of " << settings.tileSize << "x" << settings.tileSize << " on " << settings.threadCount << " threads" << std::endl;
+	}
+
+	if(serve || serveSocket != NULL) {
+		RenderServer server = RenderServer(raytracerScene, settings);
+		bool ok = true;
+		if(serveSocket != NULL) {
+			ok = server.ServeSocket(serveSocket);
+		}
+		else {
+			server.ServeStream(stdin, stdout);
+		}
+
+		delete raytracerScene;
 
-	int imgW = raytracerScene->imageWidth;
-	int imgH = raytracerScene->imageHeight;
-	double halfW = imgW/2;
-	double halfH = imgH/2;
-	float d = halfH / tanf(camera.halfAngleFov * (M_PI / 180.0f));
+		return ok ? 0 : 1;
+	}
+
+	if(batchFile != NULL) {
+		if(settings.timeBudget > 0 && batchJobs > 1) {		// The budget may lower the scene's max_depth mid-render
+			std::cerr << "-time-budget renders batch views one at a time" << std::endl;
+			batchJobs = 1;
+		}
+
+		BatchRenderer batch = BatchRenderer(raytracerScene, settings);
+		bool ok = batch.LoadBatchFile(batchFile);
+		if(ok) {
+			double start = omp_get_wtime();
+			ok = batch.RenderAll(batchJobs);
+			double end = omp_get_wtime();
+			std::cout << "Rendered " << batch.views.size() << " views in " << end - start << " seconds" << std::endl;
+		}
+
+		delete raytracerScene;
+
+		return ok ? 0 : 1;
+	}
+
+	if(workerAddress != NULL) {
+		bool ok = RunWorker(raytracerScene, settings, workerAddress, RenderHash(fileName, raytracerScene));
+
+		delete raytracerScene;
+
+		return ok ? 0 : 1;
+	}
 
 	double start = omp_get_wtime();
-	double totalTime = 0;
-	Image outputImage = Image(raytracerScene->imageWidth, raytracerScene->imageHeight);
-	#pragma omp parallel for num_threads(12)
-	for(int j = 0; j < raytracerScene->imageHeight; j++) {
-		for(int i = 0; i < raytracerScene->imageWidth; i++) {
-			totalTime += RayTracePixel(i, j, camera, imgH, imgW, halfW, halfH, d, raytracerScene, &outputImage);
+	Renderer renderer = Renderer(raytracerScene, settings);
+	if(crop.x1 > crop.x0 && crop.y1 > crop.y0) {
+		raytracerScene->cropX0 = crop.x0;
+		raytracerScene->cropY0 = crop.y0;
+		raytracerScene->cropX1 = crop.x1;
+		raytracerScene->cropY1 = crop.y1;
+	}
+	if(cropBase != NULL) {
+		raytracerScene->cropBase = cropBase;
+	}
+	if(raytracerScene->cropX1 > raytracerScene->cropX0 && raytracerScene->cropY1 > raytracerScene->cropY0) {
+		renderer.SetCrop(Tile{raytracerScene->cropX0, raytracerScene->cropY0, raytracerScene->cropX1, raytracerScene->cropY1}, raytracerScene->cropBase);
+		const Tile &region = renderer.region;
+		if(renderer.RegionPixels() == 0) {
+			std::cerr << "Crop window is outside the " << raytracerScene->imageWidth << "x" << raytracerScene->imageHeight << " film" << std::endl;
+			delete raytracerScene;
+			return 1;
 		}
-		if(j%32 == 0) {
-			double elapsed =  round((j / (double) imgH) * 100);
-			std::cout << elapsed << "%" << std::endl;
+		std::cout << "Crop window " << region.x0 << " " << region.y0 << " to " << region.x1 << " " << region.y1;
+		if(!raytracerScene->cropBase.empty()) {
+			std::cout << ", pasted into " << raytracerScene->cropBase;
 		}
+		std::cout << std::endl;
+	}
+	if(checkpoint) {
+		if(coordinator != NULL || settings.timeBudget > 0) {
+			std::cerr << "-checkpoint and -resume only work on local renders without -time-budget" << std::endl;
+			checkpoint = false;
+		}
+		else {
+			if(checkpointPath.empty()) {
+				checkpointPath = raytracerScene->outputImage + ".ckpt";
+			}
+			renderer.EnableCheckpoints(checkpointPath, checkpointInterval, RenderHash(fileName, raytracerScene));
+			if(resume) {
+				renderer.ResumeCheckpoint();
+			}
+		}
+	}
+	if(coordinator != NULL) {
+		if(settings.progressive || settings.timeBudget > 0) {
+			std::cerr << "-coordinator renders a single pass, -progressive and -time-budget are ignored" << std::endl;
+		}
+		coordinator->renderHash = RenderHash(fileName, raytracerScene);
+		coordinator->Render(raytracerScene, renderer, jobSize);
+		delete coordinator;
+	}
+	else {
+		renderer.Render();
 	}
 	double end = omp_get_wtime();
 	
 	std::cout << "Done!" << std::endl;
-	//std::cout << "Raytracing took: " << totalTime << " seconds" << std::endl;
 	std::cout << "Raytracing took: " << end - start << " seconds" << std::endl;
 
-	outputImage.Write(raytracerScene->outputImage.c_str());
+	bool written = renderer.WriteImage(raytracerScene->outputImage.c_str());
+	if(checkpoint && written) {
+		renderer.RemoveCheckpoint();
+	}
+	else if(checkpoint) {
+		renderer.KeepCheckpoint();
+	}
 
 	delete raytracerScene;
 
-	return 0;
-}
\ No newline at end of file
+	return written ? 0 : 1;
+}
@@ -4,10 +4,19 @@
 #include "Math.h"
 #include "scene/SceneLoader.h"
 
-bool HitCheckTriangle(Vec3f start, Vec3f dir, Triangle triangle, float tMax, float &tHit, float &u, float &v);
+bool HitCheckTriangle(Vec3f start, Vec3f dir, const Triangle &triangle, float tMax, float &tHit, float &u, float &v);
 bool HitCheckSphere(Vec3f start, Vec3f dir, float tMax, Vec3f spherePos, float r, float &tHit);
 bool HitCheckScene(Vec3f start, Vec3f dir, float tMax, Scene *scene);
 float GetFresnelFactor(float refractionCoeff1, float refractionCoeff2, Vec3f v, Vec3f n);
-Color Shade(Vec3f v, Vec3f n, Vec3f p, Material material, Scene *scene, bool noRefract, int depth);
-Color RayTraceScene(Vec3f start, Vec3f dir, Scene *scene, int depth);
+int LightCount(const Scene *scene);
+bool LightRay(int light, Vec3f n, Vec3f p, Scene *scene, Vec3f &toLight, float &tMax);
+Color AddLight(Color shade, int light, Vec3f v, Vec3f n, Vec3f p, const Material &material, Scene *scene);
+Color ShadeDirect(Vec3f v, Vec3f n, Vec3f p, const Material &material, Scene *scene);
+bool ClosestHit(Vec3f start, Vec3f dir, Scene *scene, Vec3f &v, Vec3f &n, Vec3f &p, Material &material, const TriangleHit *knownHit = NULL);
+void TracePrimaryPacket(const RayPacket &packet, Scene *scene, TriangleHit *hits);
+float HitFresnelFactor(Vec3f v, Vec3f n, const Material &material);
+bool ReflectedRay(Vec3f v, Vec3f n, const Material &material, const Color &weight, Scene *scene, Vec3f &dir, Color &childWeight);
+bool RefractedRay(Vec3f v, Vec3f n, const Material &material, float fresnelFactor, const Color &weight, Scene *scene, Vec3f &dir, Color &childWeight);
+Color ClampColor(const Color &c);
+Color RayTraceScene(Vec3f start, Vec3f dir, Scene *scene, int depth, const TriangleHit *primaryHit = NULL);
 #endif
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "RenderServer.h"
+
+#include <omp.h>
+
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+
+#define ACCEPT_RETRY_MS 100		// Wait before accepting again when the process is out of descriptors
+
+RenderServer::RenderServer(Scene *scene, const RenderSettings &settings) : scene(scene), settings(settings) {
+	current = SceneView(scene);
+}
+
+bool RenderServer::HandleRequest(const std::string &line, FILE *out) {
+	// Not ParseArgsFromLine, a long line from a client shouldn't abort the server
+	std::vector<std::string> args;
+	std::istringstream iss(line);
+	std::string arg;
+	while(iss >> arg) {
+		args.push_back(arg);
+	}
+
+	if(args.empty() || args[0][0] == '#') {
+		return true;
+	}
+	if(args.size() > MAX_ARGS) {
+		fprintf(out, "error too many arguments for %s\n", args[0].c_str());
+		fflush(out);
+		return true;
+	}
+	args.resize(MAX_ARGS + 1);		// Missing arguments come through as "" and fail to convert
+
+	try {
+		if(args[0] == "render:") {
+			RenderView view = current;
+			SceneLoader::FinishCamera(view.camera);
+
+			double start = omp_get_wtime();
+			Renderer renderer = Renderer(scene, view, settings);
+			renderer.Render();
+			bool written = renderer.WriteImage(view.outputImage.c_str());
+			double end = omp_get_wtime();
+
+			if(written) {
+				fprintf(out, "done %s %f\n", view.outputImage.c_str(), end - start);
+			}
+			else {
+				fprintf(out, "error could not write %s\n", view.outputImage.c_str());
+			}
+		}
+		else if(args[0] == "quit:") {
+			quit = true;
+			return false;
+		}
+		else if(args[0] == "clear_lights:") {
+			scene->directionalLights.clear();
+			scene->pointLights.clear();
+			scene->spotLights.clear();
+		}
+		else if(args[0] == "samples_per_pixel:") {
+			scene->samplesPerPixel = std::max(stoi(args[1]), 1);
+		}
+		else if(args[0] == "max_depth:") {
+			scene->maxDepth = stoi(args[1]);
+		}
+		else if(!loader.ParseViewDirective(args, current.camera, current.width, current.height, current.outputImage) && !loader.ParseLightDirective(args, scene)) {
+			fprintf(out, "error unknown request %s\n", args[0].c_str());
+		}
+	}
+	catch(const std::exception &e) {		// stof/stoi on a short or garbled line
+		fprintf(out, "error bad arguments for %s\n", args[0].c_str());
+	}
+
+	fflush(out);
+
+	return true;
+}
+
+void RenderServer::ServeStream(FILE *in, FILE *out) {
+	char *line = NULL;
+	size_t capacity = 0;
+
+	while(getline(&line, &capacity, in) > 0) {
+		if(!HandleRequest(line, out)) {
+			break;
+		}
+	}
+
+	free(line);
+}
+
+bool RenderServer::ServeSocket(const char *path) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path too long: " << path << std::endl;
+		return false;
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if(listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 4) != 0) {
+		std::cerr << "Could not listen on " << path << std::endl;
+		if(listener >= 0) {
+			close(listener);
+		}
+		return false;
+	}
+
+	signal(SIGPIPE, SIG_IGN);		// A client hanging up mid-reply shouldn't kill the server
+	std::cout << "Listening on " << path << std::endl;
+
+	bool ok = true;
+	while(!quit) {
+		int client = accept(listener, NULL, NULL);
+		if(client < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {		// Out of descriptors or memory for now, retrying at once would spin
+				std::cerr << "Could not accept a client: " << strerror(errno) << ", retrying" << std::endl;
+				usleep(ACCEPT_RETRY_MS * 1000);
+				continue;
+			}
+			std::cerr << "Could not accept on " << path << ": " << strerror(errno) << std::endl;
+			ok = false;
+			break;
+		}
+
+		FILE *in = fdopen(client, "r");
+		if(!in) {
+			std::cerr << "Could not open a stream for a client" << std::endl;
+			close(client);
+			continue;
+		}
+		int outFd = dup(client);
+		FILE *out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+		if(!out) {
+			std::cerr << "Could not open a stream for a client" << std::endl;
+			if(outFd >= 0) {
+				close(outFd);
+			}
+			fclose(in);
+			continue;
+		}
+
+		ServeStream(in, out);
+		fclose(in);
+		fclose(out);
+	}
+
+	close(listener);
+	unlink(path);
+
+	return ok;
+}
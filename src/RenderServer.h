@@ -0,0 +1,32 @@
+#ifndef RENDERSERVER_INCLUDED
+#define RENDERSERVER_INCLUDED
+
+#include "Renderer.h"
+#include "scene/SceneLoader.h"
+
+#include <stdio.h>
+#include <string>
+
+// Keeps a loaded scene and its BVHs resident and renders on request
+// Requests are scene file lines, one per line: camera, film, output, lights and sampling change the
+// state, "clear_lights:" drops every light, "render:" renders it and "quit:" stops the server
+// Only render: and bad lines get a reply, "done <output> <seconds>" or "error <message>"
+class RenderServer {
+public:
+	RenderServer(Scene *scene, const RenderSettings &settings);
+
+	void ServeStream(FILE *in, FILE *out);		// Until end of input or quit:
+	bool ServeSocket(const char *path);			// One client at a time on a Unix socket, until quit:
+
+private:
+	bool HandleRequest(const std::string &line, FILE *out);		// False once asked to quit
+
+	Scene *scene;
+	RenderSettings settings;
+	RenderView current;
+	SceneLoader loader;
+
+	bool quit = false;
+};
+
+#endif
@@ -0,0 +1,466 @@
+#include "Renderer.h"
+#include "Raytracer.h"
+
+#include <omp.h>
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+
+// Direction from the eye through offset (dx, dy) in [0, 1)^2 of pixel (i, j)
+Vec3f CameraRayDir(int i, int j, float dx, float dy, const Camera &camera, double halfW, double halfH, float d) {
+	float u = (halfW - (i + (dx - 0.5)));
+	float v = (halfH - (j + (dy - 0.5)));
+	Vec3f p = camera.eye - d * camera.fwd + u * camera.right + v * camera.up;
+	Vec3f rayDir = (p - camera.eye);
+	rayDir.Normalize();
+
+	return rayDir;
+}
+
+// Colour seen through offset (dx, dy) in [0, 1)^2 of pixel (i, j)
+Color TraceCameraSample(int i, int j, float dx, float dy, const Camera &camera, double halfW, double halfH, float d, Scene *raytracerScene) {
+	return RayTraceScene(camera.eye, CameraRayDir(i, j, dx, dy, camera, halfW, halfH, d), raytracerScene, 1);
+}
+
+// Averages sampleCount camera rays spread over the pixel footprint
+// A single sample in pass 0 is the pixel centre, anything else gets stratified jitter from rng
+Color RayTracePixel(int i, int j, const Camera &camera, double halfW, double halfH, float d, int sampleCount, int pass, Rng &rng, Scene *raytracerScene) {
+	Color color = Color(0, 0, 0);
+	rng.Seed(PixelSeed(i, j, pass));
+
+	for(int sample = 0; sample < sampleCount; sample++) {		// Do a few samples to beat aliasing
+		float dx = 0.5f;
+		float dy = 0.5f;
+		if(sampleCount > 1 || pass > 0) {
+			StratifiedSample(sample, sampleCount, rng, dx, dy);
+		}
+
+		color = color + TraceCameraSample(i, j, dx, dy, camera, halfW, halfH, d, raytracerScene);
+	}
+
+	return color / sampleCount;
+}
+
+// Traces batches of baseSamples stratified rays until the standard error of the pixel's
+// luminance drops under threshold, or maxSamples is reached. Flat pixels stop after the first batch
+Color RayTracePixelAdaptive(int i, int j, const Camera &camera, double halfW, double halfH, float d, int baseSamples, int maxSamples, float threshold, int pass, Rng &rng, Scene *raytracerScene, int &samplesTaken) {
+	Color color = Color(0, 0, 0);
+	rng.Seed(PixelSeed(i, j, pass));
+
+	// Running luminance variance (Welford)
+	float mean = 0.f;
+	float m2 = 0.f;
+	int n = 0;
+
+	while(n < maxSamples) {
+		int batch = std::min(baseSamples, maxSamples - n);
+		for(int sample = 0; sample < batch; sample++) {
+			float dx, dy;
+			StratifiedSample(sample, batch, rng, dx, dy);
+			Color c = TraceCameraSample(i, j, dx, dy, camera, halfW, halfH, d, raytracerScene);
+			color = color + c;
+
+			float luminance = 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+			n++;
+			float delta = luminance - mean;
+			mean += delta / n;
+			m2 += delta * (luminance - mean);
+		}
+
+		if(n >= 2 && sqrtf(m2 / ((n - 1) * n)) < threshold) {
+			break;
+		}
+	}
+
+	samplesTaken = n;
+
+	return color / n;
+}
+
+RenderView SceneView(const Scene *scene) {
+	RenderView view;
+	view.camera = scene->camera;
+	view.width = scene->imageWidth;
+	view.height = scene->imageHeight;
+	view.outputImage = scene->outputImage;
+
+	return view;
+}
+
+Renderer::Renderer(Scene *scene, const RenderSettings &settings) : Renderer(scene, SceneView(scene), settings) {}
+
+Renderer::Renderer(Scene *scene, const RenderView &view, const RenderSettings &settings) : scene(scene), view(view), settings(settings) {
+	imageWidth = view.width;
+	imageHeight = view.height;
+	halfW = imageWidth/2;
+	halfH = imageHeight/2;
+	d = halfH / tanf(view.camera.halfAngleFov * (M_PI / 180.0f));
+
+	accum = new Color[imageWidth * imageHeight];
+	sampleCounts = new int[imageWidth * imageHeight]();
+
+	region = Tile{0, 0, imageWidth, imageHeight};
+}
+
+Renderer::~Renderer() {
+	delete[] accum;
+	delete[] sampleCounts;
+	delete[] checkpointAccum;
+	delete[] checkpointCounts;
+}
+
+// Traces every stride-th pixel in x and y with the given sampling and adds it to the sums
+// Returns how many camera rays went out
+long long Renderer::RenderPass(int pass, int sampleCount, int maxSampleCount, int stride) {
+	const Camera &camera = view.camera;
+	bool adaptive = maxSampleCount > sampleCount;
+	bool packets = settings.packets && !adaptive && scene->accelerate && scene->hasBvh;		// Adaptive pixels stop at different sample counts
+
+	// Checkpoints are kept per tile, the wavefront has none
+	if(settings.wavefront && !adaptive && checkpointPath.empty()) {
+		long long passSamples = RenderWavefrontPass(pass, sampleCount, stride);
+		totalSamples += passSamples;
+		return passSamples;
+	}
+
+	TileScheduler scheduler(region, settings.tileSize, settings.tileOrder, settings.threadCount);
+	scheduler.reportProgress = settings.verbose;
+
+	bool checkpointing = !checkpointPath.empty();
+	if(checkpointing) {
+		BeginCheckpointPass(pass, scheduler.tileCount);
+	}
+
+	long long passSamples = 0;
+	#pragma omp parallel num_threads(settings.threadCount)
+	{
+		int thread = omp_get_thread_num();
+		Rng rng;		// Per thread, reseeded for every pixel
+		Tile tile;
+		while(scheduler.NextTile(thread, tile)) {
+			int tileIdx = scheduler.TileIndex(tile);
+			if(checkpointing && tileDone[tileIdx]) {		// Finished before the restart
+				scheduler.FinishTile(thread, 0);
+				continue;
+			}
+
+			double tileStart = omp_get_wtime();
+			long long tileSamples = 0;
+			if(packets) {
+				tileSamples = TracePacketTile(tile, pass, sampleCount, stride);
+			}
+			else {
+				int firstI = tile.x0 + (stride - tile.x0 % stride) % stride;
+				int firstJ = tile.y0 + (stride - tile.y0 % stride) % stride;
+				for(int j = firstJ; j < tile.y1; j += stride) {
+					for(int i = firstI; i < tile.x1; i += stride) {
+						Color color;
+						int samplesTaken = sampleCount;
+						if(adaptive) {
+							color = RayTracePixelAdaptive(i, j, camera, halfW, halfH, d, sampleCount, maxSampleCount, scene->adaptiveThreshold, pass, rng, scene, samplesTaken);
+						}
+						else {
+							color = RayTracePixel(i, j, camera, halfW, halfH, d, sampleCount, pass, rng, scene);
+						}
+
+						int pixel = i + j * imageWidth;
+						accum[pixel] = accum[pixel] + samplesTaken * color;
+						sampleCounts[pixel] += samplesTaken;
+						tileSamples += samplesTaken;
+					}
+				}
+			}
+			#pragma omp atomic
+			passSamples += tileSamples;
+
+			if(checkpointing) {
+				FinishCheckpointTile(tile, tileIdx, tileSamples);
+			}
+
+			scheduler.FinishTile(thread, omp_get_wtime() - tileStart);
+		}
+	}
+
+	totalSamples += passSamples;
+	if(settings.verbose && !settings.progressive && settings.timeBudget <= 0) {
+		scheduler.PrintStats();
+	}
+
+	return passSamples;
+}
+
+// The traced pixels of a tile in blocks of RAY_PACKET_SIDE x RAY_PACKET_SIDE, one packet per sample index
+// Each pixel keeps its own rng and sums its samples in the same order as RayTracePixel, so the image is unchanged
+long long Renderer::TracePacketTile(const Tile &tile, int pass, int sampleCount, int stride) {
+	const Camera &camera = view.camera;
+	int firstI = tile.x0 + (stride - tile.x0 % stride) % stride;
+	int firstJ = tile.y0 + (stride - tile.y0 % stride) % stride;
+	long long tileSamples = 0;
+
+	RayPacket packet;
+	TriangleHit hits[RAY_PACKET_SIZE];
+	Rng rngs[RAY_PACKET_SIZE];
+	Color colors[RAY_PACKET_SIZE];
+	int pixelI[RAY_PACKET_SIZE], pixelJ[RAY_PACKET_SIZE];
+
+	for(int blockJ = firstJ; blockJ < tile.y1; blockJ += RAY_PACKET_SIDE * stride) {
+		for(int blockI = firstI; blockI < tile.x1; blockI += RAY_PACKET_SIDE * stride) {
+			int count = 0;
+			for(int j = blockJ; j < std::min(blockJ + RAY_PACKET_SIDE * stride, tile.y1); j += stride) {
+				for(int i = blockI; i < std::min(blockI + RAY_PACKET_SIDE * stride, tile.x1); i += stride) {
+					pixelI[count] = i;
+					pixelJ[count] = j;
+					rngs[count].Seed(PixelSeed(i, j, pass));
+					colors[count] = Color(0, 0, 0);
+					packet.startX[count] = camera.eye.x;
+					packet.startY[count] = camera.eye.y;
+					packet.startZ[count] = camera.eye.z;
+					count++;
+				}
+			}
+			packet.count = count;
+
+			for(int sample = 0; sample < sampleCount; sample++) {
+				for(int r = 0; r < count; r++) {
+					float dx = 0.5f;
+					float dy = 0.5f;
+					if(sampleCount > 1 || pass > 0) {
+						StratifiedSample(sample, sampleCount, rngs[r], dx, dy);
+					}
+
+					Vec3f rayDir = CameraRayDir(pixelI[r], pixelJ[r], dx, dy, camera, halfW, halfH, d);
+					packet.dirX[r] = rayDir.x;
+					packet.dirY[r] = rayDir.y;
+					packet.dirZ[r] = rayDir.z;
+				}
+
+				TracePrimaryPacket(packet, scene, hits);
+				for(int r = 0; r < count; r++) {
+					Vec3f rayDir = Vec3f(packet.dirX[r], packet.dirY[r], packet.dirZ[r]);
+					colors[r] = colors[r] + RayTraceScene(camera.eye, rayDir, scene, 1, &hits[r]);
+				}
+			}
+
+			for(int r = 0; r < count; r++) {
+				int pixel = pixelI[r] + pixelJ[r] * imageWidth;
+				accum[pixel] = accum[pixel] + sampleCount * (colors[r] / sampleCount);
+				sampleCounts[pixel] += sampleCount;
+				tileSamples += sampleCount;
+			}
+		}
+	}
+
+	return tileSamples;
+}
+
+void Renderer::Render() {
+	if(settings.timeBudget > 0) {
+		RenderWithBudget();
+		return;
+	}
+
+	const char *output = view.outputImage.c_str();
+	double start = omp_get_wtime();
+	double lastFlush = start;
+
+	for(int pass = resumePass; pass < settings.passes; pass++) {
+		if(settings.progressive && pass == 0) {		// Quick preview, one centre ray
+			RenderPass(pass, 1, 0, 1);
+		}
+		else {
+			RenderPass(pass, scene->samplesPerPixel, scene->maxSamplesPerPixel, 1);
+		}
+
+		double now = omp_get_wtime();
+		if(settings.progressive) {
+			std::cout << "Pass " << pass + 1 << "/" << settings.passes << " done at " << now - start << " seconds, " << totalSamples / (double) RegionPixels() << " samples per pixel" << std::endl;
+		}
+		if(pass + 1 < settings.passes && now - lastFlush >= settings.flushInterval) {
+			WriteImage(output);
+			lastFlush = now;
+		}
+	}
+
+	std::cout << "Average samples per pixel: " << totalSamples / (double) RegionPixels() << std::endl;
+}
+
+// Probes throughput on a sparse pass, then spends what is left of the budget.
+// If a full-resolution pass won't fit, reflection/refraction depth goes first, then resolution.
+// Whatever time remains buys extra jittered passes of up to samplesPerPixel each
+void Renderer::RenderWithBudget() {
+	const char *output = view.outputImage.c_str();
+	double start = omp_get_wtime();
+	double deadline = start + settings.timeBudget;
+	double lastFlush = start;
+	int savedDepth = scene->maxDepth;
+	int pass = 0;
+
+	// One centre ray per block. Doubles as the coarsest preview
+	double passStart = omp_get_wtime();
+	long long rays = RenderPass(pass++, 1, 0, BUDGET_PROBE_STRIDE);
+	double secondsPerRay = (omp_get_wtime() - passStart) / rays;
+	fillStride = BUDGET_PROBE_STRIDE;
+
+	double remaining = (deadline - omp_get_wtime()) * BUDGET_SAFETY;
+	long long pixels = RegionPixels();
+	if(remaining < pixels * secondsPerRay && scene->maxDepth > 1) {
+		scene->maxDepth = 1;
+		ClearRegion();		// Replaces the full-depth probe, so its pixels don't average two depths
+		totalSamples -= rays;
+		passStart = omp_get_wtime();
+		rays = RenderPass(pass++, 1, 0, BUDGET_PROBE_STRIDE);
+		secondsPerRay = (omp_get_wtime() - passStart) / rays;
+		remaining = (deadline - omp_get_wtime()) * BUDGET_SAFETY;
+	}
+
+	int stride = 1;
+	while(stride < BUDGET_PROBE_STRIDE && remaining < (pixels / (stride * stride)) * secondsPerRay) {
+		stride *= 2;
+	}
+
+	if(stride < BUDGET_PROBE_STRIDE) {
+		passStart = omp_get_wtime();
+		long long stridePixels = RenderPass(pass++, 1, 0, stride);
+		secondsPerRay = (omp_get_wtime() - passStart) / stridePixels;
+		fillStride = stride;
+
+		double writeSeconds = 0;
+		while(true) {
+			double now = omp_get_wtime();
+			if(now - lastFlush >= settings.flushInterval) {
+				WriteImage(output);
+				lastFlush = omp_get_wtime();
+				writeSeconds = lastFlush - now;
+				now = lastFlush;
+			}
+
+			// Leave room for the write after the next pass and for the final one
+			remaining = (deadline - now - 2 * writeSeconds) * BUDGET_SAFETY;
+			int sampleCount = std::min(scene->samplesPerPixel, (int) (remaining / (stridePixels * secondsPerRay)));
+			if(sampleCount < 1) {
+				break;
+			}
+
+			passStart = omp_get_wtime();
+			rays = RenderPass(pass++, sampleCount, 0, stride);
+			secondsPerRay = (omp_get_wtime() - passStart) / rays;
+		}
+	}
+
+	std::cout << "Time budget: " << settings.timeBudget << " seconds, rendered in " << omp_get_wtime() - start << " seconds" << std::endl;
+	std::cout << pass << " passes, 1 in " << fillStride << "x" << fillStride << " pixels traced, max depth " << scene->maxDepth << std::endl;
+	std::cout << "Average samples per pixel: " << totalSamples / (double) pixels << std::endl;
+
+	scene->maxDepth = savedDepth;
+}
+
+void Renderer::SetRegion(const Tile &newRegion) {
+	region.x0 = std::clamp(newRegion.x0, 0, imageWidth);
+	region.y0 = std::clamp(newRegion.y0, 0, imageHeight);
+	region.x1 = std::clamp(newRegion.x1, region.x0, imageWidth);
+	region.y1 = std::clamp(newRegion.y1, region.y0, imageHeight);
+}
+
+void Renderer::ClearRegion() {
+	for(int j = region.y0; j < region.y1; j++) {
+		for(int i = region.x0; i < region.x1; i++) {
+			accum[i + j * imageWidth] = Color(0, 0, 0);
+			sampleCounts[i + j * imageWidth] = 0;
+		}
+	}
+}
+
+// Sums and counts of the region, row by row
+void Renderer::ReadRegion(Color *colors, int *counts) {
+	int width = region.x1 - region.x0;
+	for(int j = region.y0; j < region.y1; j++) {
+		std::copy(accum + region.x0 + j * imageWidth, accum + region.x0 + j * imageWidth + width, colors + (j - region.y0) * width);
+		memcpy(counts + (j - region.y0) * width, sampleCounts + region.x0 + j * imageWidth, width * sizeof(int));
+	}
+}
+
+// Adds sums and counts rendered elsewhere, laid out like ReadRegion's
+void Renderer::AddRegion(const Tile &tile, const Color *colors, const int *counts) {
+	int width = tile.x1 - tile.x0;
+	for(int j = tile.y0; j < tile.y1; j++) {
+		for(int i = tile.x0; i < tile.x1; i++) {
+			int pixel = i + j * imageWidth;
+			int local = (i - tile.x0) + (j - tile.y0) * width;
+			accum[pixel] = accum[pixel] + colors[local];
+			sampleCounts[pixel] += counts[local];
+			totalSamples += counts[local];
+		}
+	}
+}
+
+void Renderer::SetCrop(const Tile &crop, const std::string &baseImage) {
+	SetRegion(crop);
+	cropped = true;
+	cropBase = baseImage;
+}
+
+long long Renderer::RegionPixels() const {
+	return (long long) (region.x1 - region.x0) * (region.y1 - region.y0);
+}
+
+// Pixels a strided pass skipped take the traced pixel at the corner of their block,
+// or the first traced one inside the region where the corner falls outside it
+void Renderer::Resolve(Image &image, int originX, int originY) {
+	int firstI = region.x0 + (fillStride - region.x0 % fillStride) % fillStride;
+	int firstJ = region.y0 + (fillStride - region.y0 % fillStride) % fillStride;
+
+	#pragma omp parallel for num_threads(settings.threadCount)
+	for(int j = region.y0; j < region.y1; j++) {
+		for(int i = region.x0; i < region.x1; i++) {
+			int pixel = i + j * imageWidth;
+			if(sampleCounts[pixel] == 0) {
+				pixel = std::max(i - i % fillStride, firstI) + std::max(j - j % fillStride, firstJ) * imageWidth;
+			}
+			image.pixels[(i - originX) + (j - originY) * image.width] = (sampleCounts[pixel] > 0) ? accum[pixel] / sampleCounts[pixel] : scene->background;
+		}
+	}
+}
+
+bool Renderer::WriteImage(const char *fileName) {
+	Image *image = NULL;
+	int originX = 0;
+	int originY = 0;
+	if(cropped && !cropBase.empty()) {
+		image = new Image(imageWidth, imageHeight);
+		if(!image->Read(cropBase.c_str()) || image->width != imageWidth || image->height != imageHeight) {
+			std::cerr << "Could not composite into " << cropBase << ", it must be a " << imageWidth << "x" << imageHeight << " BMP. Writing the crop alone" << std::endl;
+			delete image;
+			image = NULL;
+		}
+	}
+	if(image == NULL && cropped) {
+		image = new Image(region.x1 - region.x0, region.y1 - region.y0);
+		originX = region.x0;
+		originY = region.y0;
+	}
+	if(image == NULL) {
+		image = new Image(imageWidth, imageHeight);
+	}
+	Resolve(*image, originX, originY);
+
+	// Keep the extension last, Image::Write picks the format from it
+	std::string path = fileName;
+	std::string tempPath = path + ".tmp";
+	size_t slash = path.find_last_of('/');
+	size_t dot = path.find_last_of('.');
+	if(dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+		tempPath = path.substr(0, dot) + ".tmp" + path.substr(dot);
+	}
+
+	bool ok = image->Write(tempPath.c_str()) && rename(tempPath.c_str(), fileName) == 0;
+	if(!ok) {
+		std::cerr << "Could not write " << fileName << std::endl;
+		remove(tempPath.c_str());
+	}
+
+	delete image;
+
+	return ok;
+}
@@ -0,0 +1,121 @@
+#ifndef RENDERER_INCLUDED
+#define RENDERER_INCLUDED
+
+#include "Image.h"
+#include "Sampler.h"
+#include "TileScheduler.h"
+#include "scene/Scene.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#define BUDGET_PROBE_STRIDE 4		// The time-budget probe traces one pixel per 4x4 block
+#define BUDGET_SAFETY 0.9		// Plan passes against this fraction of the time left
+#define CHECKPOINT_INTERVAL 60		// Default seconds between checkpoints
+
+// How a frame is split up and refined. Samples per pixel live on the scene
+struct RenderSettings {
+	int threadCount = 1;
+	int tileSize = DEFAULT_TILE_SIZE;
+	TileOrder tileOrder = TILE_ORDER_MORTON;
+	bool verbose = true;		// Progress and per-thread stats
+	bool packets = false;		// Camera rays go through the BVH in packets. Not with adaptive sampling
+	bool wavefront = false;		// Passes run stage by stage over ray queues, see Wavefront.cpp. Not with adaptive sampling or checkpoints
+	bool sortRays = false;		// Reflection and refraction rays are sorted for coherence before each bounce. Wavefront only
+
+	// Progressive mode: pass 0 is one centre ray per pixel, every later pass adds the scene's samples on top
+	bool progressive = false;
+	int passes = 1;
+	double flushInterval = 0;		// Seconds between intermediate images. 0 writes one after every pass
+
+	double timeBudget = 0;		// Seconds left for the render. Above 0, passes are planned to fit in it
+};
+
+// What one render looks through and where it goes
+// Several views can share one loaded scene
+struct RenderView {
+	Camera camera;
+	int width, height;
+	std::string outputImage;
+};
+
+RenderView SceneView(const Scene *scene);		// The scene file's own camera and film
+
+Vec3f CameraRayDir(int i, int j, float dx, float dy, const Camera &camera, double halfW, double halfH, float d);
+Color TraceCameraSample(int i, int j, float dx, float dy, const Camera &camera, double halfW, double halfH, float d, Scene *raytracerScene);
+Color RayTracePixel(int i, int j, const Camera &camera, double halfW, double halfH, float d, int sampleCount, int pass, Rng &rng, Scene *raytracerScene);
+Color RayTracePixelAdaptive(int i, int j, const Camera &camera, double halfW, double halfH, float d, int baseSamples, int maxSamples, float threshold, int pass, Rng &rng, Scene *raytracerScene, int &samplesTaken);
+
+// Renders a scene into a running per-pixel sum, so later passes refine what is already there
+class Renderer {
+public:
+	Renderer(Scene *scene, const RenderSettings &settings);
+	Renderer(Scene *scene, const RenderView &view, const RenderSettings &settings);
+	~Renderer();
+
+	void Render();		// Every pass, flushing along the way
+	long long RenderPass(int pass, int sampleCount, int maxSampleCount, int stride);
+	void RenderWithBudget();
+
+	// Passes only touch pixels inside the region, the whole film unless set
+	void SetRegion(const Tile &newRegion);
+	void ClearRegion();
+	void ReadRegion(Color *colors, int *counts);
+	void AddRegion(const Tile &tile, const Color *colors, const int *counts);
+
+	// Crop window: only these film pixels are rendered, with the same camera rays as the full frame
+	// The image written is the crop alone, or the crop pasted into baseImage when that is set
+	void SetCrop(const Tile &crop, const std::string &baseImage);
+	long long RegionPixels() const;
+
+	void Resolve(Image &image, int originX, int originY);		// The region, into an image whose top left is film pixel (originX, originY)
+	bool WriteImage(const char *fileName);		// Through a temporary file, so readers never see half an image. False if it failed
+
+	// Every interval seconds the sums of the finished tiles go to disk, see Checkpoint.cpp
+	// Not with the time budget. renderHash is the RenderHash of the scene file, so an edited scene never resumes
+	void EnableCheckpoints(const std::string &path, double interval, uint64_t renderHash);
+	bool ResumeCheckpoint();		// Continues from a checkpoint left by the same scene and settings
+	void RemoveCheckpoint();		// Once the final image is written
+	void KeepCheckpoint();		// When it could not be, so -resume can still write it without rendering again
+
+	long long totalSamples = 0;
+	Tile region;
+
+private:
+	Scene *scene;
+	RenderView view;
+	RenderSettings settings;
+
+	int imageWidth, imageHeight;
+	double halfW, halfH;
+	float d;		// Distance to the image plane, in pixels
+
+	Color *accum;			// Sum of every sample so far
+	int *sampleCounts;
+	int fillStride = 1;		// Coarsest stride traced so far, for filling skipped pixels
+
+	long long RenderWavefrontPass(int pass, int sampleCount, int stride);
+	long long TracePacketTile(const Tile &tile, int pass, int sampleCount, int stride);
+
+	bool cropped = false;
+	std::string cropBase;
+
+	void BeginCheckpointPass(int pass, int tileCount);
+	void FinishCheckpointTile(const Tile &tile, int tileIdx, long long tileSamples);
+	void WriteCheckpoint();
+
+	// What goes to disk: sums from before the current pass, with the finished tiles of this pass copied over
+	std::string checkpointPath;
+	double checkpointInterval = CHECKPOINT_INTERVAL;
+	uint64_t checkpointHash = 0;
+	double lastCheckpoint = 0;
+	int checkpointPass = -1;
+	int resumePass = 0;
+	std::vector<char> tileDone;		// Of checkpointPass
+	Color *checkpointAccum = NULL;
+	int *checkpointCounts = NULL;
+	long long checkpointSamples = 0;
+};
+
+#endif
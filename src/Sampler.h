@@ -0,0 +1,54 @@
+#ifndef SAMPLER_INCLUDED
+#define SAMPLER_INCLUDED
+
+#include <stdint.h>
+#include <math.h>
+
+// Small PCG32 generator. Each thread keeps its own and reseeds it per pixel,
+// so a pixel gets the same samples whatever thread or tile order renders it
+struct Rng {
+	void Seed(uint64_t seed) {
+		state = 0;
+		NextUint();
+		state += seed;
+		NextUint();
+	}
+
+	uint32_t NextUint() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+		uint32_t xorShifted = (uint32_t) (((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = (uint32_t) (old >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+	}
+
+	float NextFloat() {		// [0, 1)
+		return (NextUint() >> 8) * (1.f / 16777216.f);
+	}
+
+	uint64_t state = 0;
+};
+
+// Seed for pixel (i, j) of a given pass, spread so neighbouring pixels aren't correlated
+static inline uint64_t PixelSeed(int i, int j, int pass) {
+	uint64_t h = ((uint64_t) (uint32_t) j << 32) | (uint32_t) i;
+	h ^= (uint64_t) pass * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Offset in [0, 1)^2 of sample k out of count, jittered inside its stratum
+// Strata are a near-square grid, the last row stretched over whatever samples are left
+static inline void StratifiedSample(int k, int count, Rng &rng, float &dx, float &dy) {
+	int columns = (int) ceilf(sqrtf((float) count));
+	int rows = (count + columns - 1) / columns;
+	int row = k / columns;
+	int rowCount = (row == rows - 1) ? count - row * columns : columns;
+
+	dx = ((k % columns) + rng.NextFloat()) / rowCount;
+	dy = (row + rng.NextFloat()) / rows;
+}
+
+#endif
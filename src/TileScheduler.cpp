@@ -0,0 +1,160 @@
+#include "TileScheduler.h"
+
+#include <iostream>
+#include <algorithm>
+#include <stdint.h>
+#include <math.h>
+
+// Interleaves the low 16 bits of x and y
+static uint32_t MortonCode(uint32_t x, uint32_t y) {
+	uint32_t code = 0;
+	for(int bit = 0; bit < 16; bit++) {
+		code |= ((x >> bit) & 1) << (2 * bit);
+		code |= ((y >> bit) & 1) << (2 * bit + 1);
+	}
+
+	return code;
+}
+
+TileScheduler::TileScheduler(int imgW, int imgH, int tileSize, TileOrder order, int threadCount) : TileScheduler(Tile{0, 0, imgW, imgH}, tileSize, order, threadCount) {}
+
+TileScheduler::TileScheduler(const Tile &region, int tileSize, TileOrder order, int threadCount) : threadCount(threadCount), region(region), tileSize(tileSize) {
+	tilesX = std::max((region.x1 - region.x0 + tileSize - 1) / tileSize, 0);
+	tilesY = std::max((region.y1 - region.y0 + tileSize - 1) / tileSize, 0);
+	tileCount = tilesX * tilesY;
+
+	tileOrder = new int[tileCount];
+	OrderTiles(order);
+
+	// Even contiguous runs, the first (tileCount % threadCount) threads get one extra
+	queues = new TileQueue[threadCount];
+	int begin = 0;
+	for(int i = 0; i < threadCount; i++) {
+		int count = tileCount / threadCount + (i < tileCount % threadCount ? 1 : 0);
+		omp_init_lock(&queues[i].lock);
+		queues[i].head = begin;
+		queues[i].tail = begin + count;
+		queues[i].tilesDone = 0;
+		queues[i].tilesStolen = 0;
+		queues[i].busyTime = 0;
+		begin += count;
+	}
+}
+
+TileScheduler::~TileScheduler() {
+	for(int i = 0; i < threadCount; i++) {
+		omp_destroy_lock(&queues[i].lock);
+	}
+	delete[] queues;
+	delete[] tileOrder;
+}
+
+void TileScheduler::OrderTiles(TileOrder order) {
+	uint32_t *keys = new uint32_t[tileCount];
+	float centreX = (tilesX - 1) / 2.f;
+	float centreY = (tilesY - 1) / 2.f;
+
+	for(int t = 0; t < tileCount; t++) {
+		int tx = t % tilesX;
+		int ty = t / tilesX;
+		tileOrder[t] = t;
+
+		if(order == TILE_ORDER_MORTON) {
+			keys[t] = MortonCode(tx, ty);
+		}
+		else if(order == TILE_ORDER_SPIRAL) {
+			// Square rings around the centre, walked by angle within a ring
+			float dx = tx - centreX;
+			float dy = ty - centreY;
+			uint32_t ring = (uint32_t) std::max(fabsf(dx), fabsf(dy));
+			uint32_t angle = (uint32_t) ((atan2f(dy, dx) + M_PI) * (1000.f / (2.f * M_PI)));
+			keys[t] = ring * 1024 + angle;
+		}
+		else {
+			keys[t] = t;
+		}
+	}
+
+	std::stable_sort(tileOrder, tileOrder + tileCount, [keys](int a, int b) {
+		return keys[a] < keys[b];
+	});
+
+	delete[] keys;
+}
+
+bool TileScheduler::PopFront(int queue, int &tileIdx) {
+	TileQueue &q = queues[queue];
+	bool found = false;
+
+	omp_set_lock(&q.lock);
+	if(q.head < q.tail) {
+		tileIdx = tileOrder[q.head++];
+		found = true;
+	}
+	omp_unset_lock(&q.lock);
+
+	return found;
+}
+
+bool TileScheduler::PopBack(int queue, int &tileIdx) {
+	TileQueue &q = queues[queue];
+	bool found = false;
+
+	omp_set_lock(&q.lock);
+	if(q.head < q.tail) {
+		tileIdx = tileOrder[--q.tail];
+		found = true;
+	}
+	omp_unset_lock(&q.lock);
+
+	return found;
+}
+
+// Own queue first, then steal from the far end of the others, starting with the next thread
+bool TileScheduler::NextTile(int thread, Tile &tile) {
+	int tileIdx;
+	bool found = PopFront(thread, tileIdx);
+
+	for(int i = 1; i < threadCount && !found; i++) {
+		if(PopBack((thread + i) % threadCount, tileIdx)) {
+			queues[thread].tilesStolen++;
+			found = true;
+		}
+	}
+
+	if(!found) {
+		return false;
+	}
+
+	tile.x0 = region.x0 + (tileIdx % tilesX) * tileSize;
+	tile.y0 = region.y0 + (tileIdx / tilesX) * tileSize;
+	tile.x1 = std::min(tile.x0 + tileSize, region.x1);
+	tile.y1 = std::min(tile.y0 + tileSize, region.y1);
+
+	return true;
+}
+
+int TileScheduler::TileIndex(const Tile &tile) const {
+	return ((tile.y0 - region.y0) / tileSize) * tilesX + (tile.x0 - region.x0) / tileSize;
+}
+
+void TileScheduler::FinishTile(int thread, double seconds) {
+	queues[thread].tilesDone++;
+	queues[thread].busyTime += seconds;
+
+	int finished;
+	#pragma omp atomic capture
+	finished = ++tilesFinished;
+
+	// Print every 10%, only the thread crossing the mark does it
+	if(reportProgress && (finished * 10) / tileCount != ((finished - 1) * 10) / tileCount) {
+		#pragma omp critical(tileProgress)
+		std::cout << (finished * 100) / tileCount << "%" << std::endl;
+	}
+}
+
+void TileScheduler::PrintStats() {
+	for(int i = 0; i < threadCount; i++) {
+		std::cout << "Thread " << i << ": " << queues[i].tilesDone << " tiles (" << queues[i].tilesStolen << " stolen), busy " << queues[i].busyTime << " seconds" << std::endl;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef TILESCHEDULER_INCLUDED
+#define TILESCHEDULER_INCLUDED
+
+#include <omp.h>
+
+#define DEFAULT_TILE_SIZE 16
+
+// Order tiles are handed out in. Each thread starts on its own stretch of it
+enum TileOrder {
+	TILE_ORDER_SCANLINE,
+	TILE_ORDER_MORTON,		// Z-curve, neighbouring tiles stay together. The default
+	TILE_ORDER_SPIRAL		// Centre outwards, so the interesting part finishes first
+};
+
+// Pixels [x0, x1) x [y0, y1)
+struct Tile {
+	int x0, y0, x1, y1;
+};
+
+// Splits the image into tiles and deals each thread a contiguous run of them
+// A thread pops from the front of its own run, and once that is empty steals from the back of the others
+// Everything a thread writes here is either behind its queue lock or in its own slot
+class TileScheduler {
+public:
+	TileScheduler(int imgW, int imgH, int tileSize, TileOrder order, int threadCount);
+	TileScheduler(const Tile &region, int tileSize, TileOrder order, int threadCount);		// Only tiles inside region
+	~TileScheduler();
+
+	bool NextTile(int thread, Tile &tile);
+	void FinishTile(int thread, double seconds);		// Timing and progress, after the tile is done
+	int TileIndex(const Tile &tile) const;		// Row-major position in the grid, whatever the order
+
+	void PrintStats();
+
+	int tileCount;
+	int threadCount;
+	bool reportProgress = true;		// Print every 10%
+
+private:
+	void OrderTiles(TileOrder order);
+	bool PopFront(int queue, int &tileIdx);
+	bool PopBack(int queue, int &tileIdx);
+
+	// One per thread, padded so neighbouring locks don't share a cache line
+	struct alignas(64) TileQueue {
+		omp_lock_t lock;
+		int head, tail;		// Into tileOrder
+
+		int tilesDone, tilesStolen;
+		double busyTime;
+	};
+
+	Tile region;
+	int tileSize;
+	int tilesX, tilesY;
+
+	int *tileOrder;
+	TileQueue *queues;
+
+	int tilesFinished = 0;
+};
+
+#endif
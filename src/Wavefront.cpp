@@ -0,0 +1,386 @@
+#include "Renderer.h"
+#include "Raytracer.h"
+
+#include <omp.h>
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+
+#define WAVEFRONT_BATCH (1 << 17)		// Camera rays per batch, bounds the queue memory
+#define WAVEFRONT_CHUNK 256		// Rays a thread takes from a queue at a time
+#define SORT_AXIS_BITS 9		// Origin cells per axis in the sort key, 2^9. With the octant the key is 30 bits
+#define SORT_KEY_BITS (3 * SORT_AXIS_BITS + 3)
+#define SORT_RADIX_BITS 10		// Bits per radix sort pass
+
+// Every ray of one bounce, stored field by field so each kernel streams only what it reads
+struct RayQueue {
+	// Set when the ray is spawned
+	std::vector<Vec3f> start, dir;
+	std::vector<Color> weight;		// Scale between the ray's colour and the pixel
+
+	// Closest-hit kernel
+	std::vector<char> hit;
+	std::vector<Vec3f> v, n, p;
+	std::vector<Material> material;
+
+	// Shading kernel
+	std::vector<Color> shade;		// Direct light only
+	std::vector<float> fresnelFactor;
+	std::vector<int> reflected, refracted;		// Child in the next queue, -1 for none
+
+	std::vector<Color> color;		// Clamped result, once the next queue is resolved
+
+	int Size() const {
+		return start.size();
+	}
+
+	void Resize(int count) {
+		start.resize(count);
+		dir.resize(count);
+		weight.resize(count);
+		hit.resize(count);
+		v.resize(count);
+		n.resize(count);
+		p.resize(count);
+		material.resize(count);
+		shade.resize(count);
+		fresnelFactor.resize(count);
+		reflected.resize(count);
+		refracted.resize(count);
+		color.resize(count);
+	}
+};
+
+// Shadow rays of one queue, those of ray r at first[r] .. first[r + 1] in light order
+struct ShadowQueue {
+	std::vector<int> first;
+	std::vector<Vec3f> start, dir;
+	std::vector<float> tMax;
+	std::vector<int> light;
+	std::vector<char> occluded;
+};
+
+static void TraceQueue(RayQueue &queue, Scene *scene, int threadCount) {
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int r = 0; r < queue.Size(); r++) {
+		queue.hit[r] = ClosestHit(queue.start[r], queue.dir[r], scene, queue.v[r], queue.n[r], queue.p[r], queue.material[r]);
+	}
+}
+
+// Counted first, then written, so the queue only holds lights that face their point
+static void SpawnShadowRays(const RayQueue &queue, ShadowQueue &shadows, Scene *scene, int threadCount) {
+	int lightCount = LightCount(scene);
+	shadows.first.assign(queue.Size() + 1, 0);
+
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int r = 0; r < queue.Size(); r++) {
+		if(!queue.hit[r]) {
+			continue;
+		}
+		for(int light = 0; light < lightCount; light++) {
+			Vec3f toLight;
+			float tMax;
+			shadows.first[r + 1] += LightRay(light, queue.n[r], queue.p[r], scene, toLight, tMax);
+		}
+	}
+
+	for(int r = 0; r < queue.Size(); r++) {
+		shadows.first[r + 1] += shadows.first[r];
+	}
+
+	int count = shadows.first[queue.Size()];
+	shadows.start.resize(count);
+	shadows.dir.resize(count);
+	shadows.tMax.resize(count);
+	shadows.light.resize(count);
+	shadows.occluded.resize(count);
+
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int r = 0; r < queue.Size(); r++) {
+		int k = shadows.first[r];
+		for(int light = 0; k < shadows.first[r + 1]; light++) {
+			if(LightRay(light, queue.n[r], queue.p[r], scene, shadows.dir[k], shadows.tMax[k])) {
+				shadows.start[k] = queue.p[r];
+				shadows.light[k] = light;
+				k++;
+			}
+		}
+	}
+}
+
+static void TraceShadowRays(ShadowQueue &shadows, Scene *scene, int threadCount) {
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int k = 0; k < (int) shadows.start.size(); k++) {
+		shadows.occluded[k] = HitCheckScene(shadows.start[k], shadows.dir[k], shadows.tMax[k], scene);
+	}
+}
+
+// Direct light from the shadow results, then which hits reflect and refract
+// Returns how many rays the next queue needs, their slots already set in reflected/refracted
+static int ShadeQueue(RayQueue &queue, const ShadowQueue &shadows, bool spawn, Scene *scene, int threadCount) {
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int r = 0; r < queue.Size(); r++) {
+		queue.reflected[r] = -1;
+		queue.refracted[r] = -1;
+		if(!queue.hit[r]) {
+			continue;
+		}
+
+		Color shade = scene->ambient * queue.material[r].ambient;
+		for(int k = shadows.first[r]; k < shadows.first[r + 1]; k++) {
+			if(!shadows.occluded[k]) {
+				shade = AddLight(shade, shadows.light[k], queue.v[r], queue.n[r], queue.p[r], queue.material[r], scene);
+			}
+		}
+		queue.shade[r] = shade;
+
+		if(spawn) {
+			queue.fresnelFactor[r] = HitFresnelFactor(queue.v[r], queue.n[r], queue.material[r]);
+
+			// 0 for now marks a child that still needs a slot
+			Vec3f dir;
+			Color weight;
+			queue.reflected[r] = ReflectedRay(queue.v[r], queue.n[r], queue.material[r], queue.weight[r], scene, dir, weight) ? 0 : -1;
+			queue.refracted[r] = RefractedRay(queue.v[r], queue.n[r], queue.material[r], queue.fresnelFactor[r], queue.weight[r], scene, dir, weight) ? 0 : -1;
+		}
+	}
+
+	// Children keep their parents' order, the reflection first
+	int children = 0;
+	for(int r = 0; r < queue.Size(); r++) {
+		if(queue.reflected[r] == 0) {
+			queue.reflected[r] = children++;
+		}
+		if(queue.refracted[r] == 0) {
+			queue.refracted[r] = children++;
+		}
+	}
+
+	return children;
+}
+
+// The rays ShadeQueue made room for. Recomputed, which is cheaper than keeping every candidate around
+static void SpawnChildren(const RayQueue &queue, RayQueue &next, Scene *scene, int threadCount) {
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int r = 0; r < queue.Size(); r++) {
+		int child = queue.reflected[r];
+		if(child >= 0) {
+			next.start[child] = queue.p[r];
+			ReflectedRay(queue.v[r], queue.n[r], queue.material[r], queue.weight[r], scene, next.dir[child], next.weight[child]);
+		}
+
+		child = queue.refracted[r];
+		if(child >= 0) {
+			next.start[child] = queue.p[r];
+			RefractedRay(queue.v[r], queue.n[r], queue.material[r], queue.fresnelFactor[r], queue.weight[r], scene, next.dir[child], next.weight[child]);
+		}
+	}
+}
+
+// Interleaves the low SORT_AXIS_BITS bits of x, y and z
+static uint32_t MortonCode(uint32_t x, uint32_t y, uint32_t z) {
+	uint32_t code = 0;
+	for(int bit = 0; bit < SORT_AXIS_BITS; bit++) {
+		code |= ((x >> bit) & 1) << (3 * bit);
+		code |= ((y >> bit) & 1) << (3 * bit + 1);
+		code |= ((z >> bit) & 1) << (3 * bit + 2);
+	}
+
+	return code;
+}
+
+// LSD radix sort on the key in the upper 32 bits. Stable, so the order is the same on every run
+static void RadixSort(std::vector<uint64_t> &keys) {
+	std::vector<uint64_t> sorted(keys.size());
+	for(int shift = 32; shift < 32 + SORT_KEY_BITS; shift += SORT_RADIX_BITS) {
+		std::vector<size_t> offsets((1 << SORT_RADIX_BITS) + 1, 0);
+		for(uint64_t key : keys) {
+			offsets[((key >> shift) & ((1 << SORT_RADIX_BITS) - 1)) + 1]++;
+		}
+		for(int bucket = 0; bucket < (1 << SORT_RADIX_BITS); bucket++) {
+			offsets[bucket + 1] += offsets[bucket];
+		}
+		for(uint64_t key : keys) {
+			sorted[offsets[(key >> shift) & ((1 << SORT_RADIX_BITS) - 1)]++] = key;
+		}
+		keys.swap(sorted);
+	}
+}
+
+// Orders freshly spawned rays by direction octant, then by origin along a Z-curve over their bounding box,
+// so rays next to each other in the queue walk the same part of the BVH. The parents' child indices follow
+static void SortQueue(RayQueue &queue, RayQueue &parents, int threadCount) {
+	int count = queue.Size();
+	Vec3f lo = queue.start[0];
+	Vec3f hi = queue.start[0];
+	for(int r = 1; r < count; r++) {
+		const Vec3f &start = queue.start[r];
+		lo = Vec3f(std::min(lo.x, start.x), std::min(lo.y, start.y), std::min(lo.z, start.z));
+		hi = Vec3f(std::max(hi.x, start.x), std::max(hi.y, start.y), std::max(hi.z, start.z));
+	}
+
+	float cells = (1 << SORT_AXIS_BITS) - 1;
+	Vec3f extent = hi - lo;
+	Vec3f scale = Vec3f(extent.x > 0 ? cells / extent.x : 0, extent.y > 0 ? cells / extent.y : 0, extent.z > 0 ? cells / extent.z : 0);
+
+	// Key above, queue index below
+	std::vector<uint64_t> keys(count);
+	#pragma omp parallel for num_threads(threadCount) schedule(static)
+	for(int r = 0; r < count; r++) {
+		const Vec3f &start = queue.start[r];
+		const Vec3f &dir = queue.dir[r];
+		uint32_t octant = (dir.x < 0) | ((dir.y < 0) << 1) | ((dir.z < 0) << 2);
+		uint32_t x = (uint32_t) ((start.x - lo.x) * scale.x);
+		uint32_t y = (uint32_t) ((start.y - lo.y) * scale.y);
+		uint32_t z = (uint32_t) ((start.z - lo.z) * scale.z);
+		uint64_t key = (octant << (3 * SORT_AXIS_BITS)) | MortonCode(x, y, z);
+		keys[r] = (key << 32) | (uint32_t) r;
+	}
+
+	RadixSort(keys);
+
+	std::vector<Vec3f> start(count), dir(count);
+	std::vector<Color> weight(count);
+	std::vector<int> newIndex(count);
+	#pragma omp parallel for num_threads(threadCount) schedule(static)
+	for(int r = 0; r < count; r++) {
+		int from = (uint32_t) keys[r];
+		start[r] = queue.start[from];
+		dir[r] = queue.dir[from];
+		weight[r] = queue.weight[from];
+		newIndex[from] = r;
+	}
+	queue.start.swap(start);
+	queue.dir.swap(dir);
+	queue.weight.swap(weight);
+
+	#pragma omp parallel for num_threads(threadCount) schedule(static)
+	for(int r = 0; r < parents.Size(); r++) {
+		if(parents.reflected[r] >= 0) {
+			parents.reflected[r] = newIndex[parents.reflected[r]];
+		}
+		if(parents.refracted[r] >= 0) {
+			parents.refracted[r] = newIndex[parents.refracted[r]];
+		}
+	}
+}
+
+// Adds the resolved colours of the next queue, in the order RayTraceScene does
+static void ResolveQueue(RayQueue &queue, const RayQueue *next, Scene *scene, int threadCount) {
+	#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK)
+	for(int r = 0; r < queue.Size(); r++) {
+		if(!queue.hit[r]) {
+			queue.color[r] = scene->background;
+			continue;
+		}
+
+		Color shade = queue.shade[r];
+		if(queue.reflected[r] >= 0) {
+			shade = shade + queue.material[r].specular * next->color[queue.reflected[r]];
+		}
+		if(queue.refracted[r] >= 0) {
+			Color refraction = (1 - queue.fresnelFactor[r]) * next->color[queue.refracted[r]];
+			shade = shade + (queue.material[r].transmissive * refraction);
+		}
+		queue.color[r] = ClampColor(shade);
+	}
+}
+
+// Same pixels, samples and image as RenderPass, but stage by stage over the whole region:
+// camera rays, closest hits, all shadow rays at once, shading, then the next bounce.
+// Colours are resolved back up from the last bounce, so clamping and minRayWeight match RayTraceScene
+long long Renderer::RenderWavefrontPass(int pass, int sampleCount, int stride) {
+	const Camera &camera = view.camera;
+	int threadCount = settings.threadCount;
+	int firstI = region.x0 + (stride - region.x0 % stride) % stride;
+	int firstJ = region.y0 + (stride - region.y0 % stride) % stride;
+	int columns = std::max((region.x1 - firstI + stride - 1) / stride, 0);
+	int rows = std::max((region.y1 - firstJ + stride - 1) / stride, 0);
+	int pixelCount = columns * rows;
+	int batchPixels = std::max(WAVEFRONT_BATCH / sampleCount, 1);
+
+	std::vector<RayQueue> queues(1);		// One per bounce, reused across batches
+	ShadowQueue shadows;
+	long long cameraRays = 0, secondaryRays = 0, shadowRays = 0;
+
+	for(int batchStart = 0; batchStart < pixelCount; batchStart += batchPixels) {
+		int batchCount = std::min(batchPixels, pixelCount - batchStart);
+
+		// Camera rays, every sample of a pixel side by side. queues may move once bounces are added
+		RayQueue &cameraQueue = queues[0];
+		cameraQueue.Resize(batchCount * sampleCount);
+		#pragma omp parallel for num_threads(threadCount) schedule(dynamic, WAVEFRONT_CHUNK / 16)
+		for(int k = 0; k < batchCount; k++) {
+			int i = firstI + ((batchStart + k) % columns) * stride;
+			int j = firstJ + ((batchStart + k) / columns) * stride;
+			Rng rng;
+			rng.Seed(PixelSeed(i, j, pass));
+			for(int sample = 0; sample < sampleCount; sample++) {
+				float dx = 0.5f;
+				float dy = 0.5f;
+				if(sampleCount > 1 || pass > 0) {
+					StratifiedSample(sample, sampleCount, rng, dx, dy);
+				}
+
+				int r = k * sampleCount + sample;
+				cameraQueue.start[r] = camera.eye;
+				cameraQueue.dir[r] = CameraRayDir(i, j, dx, dy, camera, halfW, halfH, d);
+				cameraQueue.weight[r] = Color(1, 1, 1);
+			}
+		}
+		cameraRays += cameraQueue.Size();
+
+		int bounces = 0;
+		while(true) {
+			RayQueue &queue = queues[bounces];
+			TraceQueue(queue, scene, threadCount);
+			SpawnShadowRays(queue, shadows, scene, threadCount);
+			TraceShadowRays(shadows, scene, threadCount);
+			shadowRays += shadows.start.size();
+
+			bool spawn = bounces + 1 <= scene->maxDepth;		// Camera rays have depth 1
+			int children = ShadeQueue(queue, shadows, spawn, scene, threadCount);
+			bounces++;
+			if(children == 0) {
+				break;
+			}
+
+			if((int) queues.size() <= bounces) {
+				queues.resize(bounces + 1);
+			}
+			queues[bounces].Resize(children);
+			SpawnChildren(queues[bounces - 1], queues[bounces], scene, threadCount);
+			if(settings.sortRays) {
+				SortQueue(queues[bounces], queues[bounces - 1], threadCount);
+			}
+			secondaryRays += children;
+		}
+
+		for(int b = bounces - 1; b >= 0; b--) {
+			ResolveQueue(queues[b], (b + 1 < bounces) ? &queues[b + 1] : NULL, scene, threadCount);
+		}
+
+		#pragma omp parallel for num_threads(threadCount) schedule(static)
+		for(int k = 0; k < batchCount; k++) {
+			int i = firstI + ((batchStart + k) % columns) * stride;
+			int j = firstJ + ((batchStart + k) / columns) * stride;
+			Color color = Color(0, 0, 0);
+			for(int sample = 0; sample < sampleCount; sample++) {
+				color = color + queues[0].color[k * sampleCount + sample];
+			}
+			color = color / sampleCount;
+
+			int pixel = i + j * imageWidth;
+			accum[pixel] = accum[pixel] + sampleCount * color;
+			sampleCounts[pixel] += sampleCount;
+		}
+	}
+
+	if(settings.verbose && !settings.progressive && settings.timeBudget <= 0) {
+		std::cout << "Wavefront: " << cameraRays << " camera, " << secondaryRays << " reflection/refraction and " << shadowRays << " shadow rays" << std::endl;
+	}
+
+	return cameraRays;
+}
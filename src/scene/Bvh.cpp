@@ -1,35 +1,111 @@
 #include "Bvh.h"
-#include "Raytracer.h"
+#include "BvhIntersect.h"
 
 #include <vector>
 #include <iostream>
+#include <algorithm>
 
-#define MAX_T 5000
-#define RAY_EPS 0.0001		// Prevents acne
-#define PLANE_EQUALS_EPS 0.0000001		// For parallel rays
+#include <omp.h>
 
-#define GIANT_NUM 1e10f
 #define PADDING 1e-6f
 
-SceneBvh::SceneBvh(std::vector<Triangle> inputTriangles) {
+#define MIDPOINT_LEAF_SIZE 3
+#define MAX_LEAF_TRIANGLES 16		// SAH may still force a split above this
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECT_COST 1.0f
+
+#define PARALLEL_TASK_THRESHOLD 512		// Smaller subtrees are finished by the thread that split them off
+#define PARALLEL_SPLIT_THRESHOLD 4096	// Bigger nodes bin and partition with taskloops
+#define PARALLEL_BLOCK_SIZE 1024
+
+BvhTree::~BvhTree() {
+	delete[] bvhNodes;
+}
+
+// Start a build over count primitives
+// The caller fills in primBounds and centroids, then calls BuildTree
+void BvhTree::BeginBuild(int count) {
+	primCount = count;
+	primIdx = new uint[count];
+	scratchIdx = new uint[count];
+	centroids = new Vec3f[count];
+	primBounds = new BoundBoxf[count];
+
+	delete[] bvhNodes;
+	bvhNodes = new BvhNode[count * 2]; // Allocate an array of bvhNodes to store the tree
+}
+
+// Build over an index list so partitioning only swaps integers
+// Afterwards primIdx lists the primitives in leaf order
+void BvhTree::BuildTree() {
+	#pragma omp parallel for
+	for(int i = 0; i < primCount; i++) {
+		primIdx[i] = i;
+	}
+
+	if(binCount < 2) {
+		binCount = 2;
+	}
+	if(binCount > MAX_SAH_BINS) {
+		binCount = MAX_SAH_BINS;
+	}
+
+	BvhNode &root = bvhNodes[rootIdx];
+	root.left = 0;
+	root.firstTriangle = 0;
+	root.triangleCount = primCount;
+	nodesUsed = 1;
+	parallelBuild = omp_get_max_threads() > 1;
+
+	if(buildMode == BVH_BUILD_LBVH) {
+		BuildLinear();
+		return;
+	}
+
+	// Subtrees become tasks; the big nodes near the root bin and partition with taskloops
+	#pragma omp parallel
+	#pragma omp single
+	{
+		CalcBounds(rootIdx);
+		Subdivide(rootIdx, 0);
+	}
+}
+
+void BvhTree::EndBuild() {
+	delete[] primIdx;
+	delete[] scratchIdx;
+	delete[] centroids;
+	delete[] primBounds;
+	primIdx = NULL;
+	scratchIdx = NULL;
+	centroids = NULL;
+	primBounds = NULL;
+}
+
+SceneBvh::SceneBvh(const std::vector<Triangle> &inputTriangles) {
 	numTris = inputTriangles.size();
 	if(numTris == 0) {
 		return;
 	}
 	triangles = new Triangle[numTris];
-	int i = 0;
 
-	for(Triangle triangle : inputTriangles) {
-		triangles[i] = triangle;
-		i++;
+	#pragma omp parallel for
+	for(int i = 0; i < numTris; i++) {
+		triangles[i] = inputTriangles[i];
 	}
 
-	bvhNodes = new BvhNode[numTris * 2]; // Allocate an array of bvhNodes to store the tree
+#if defined(__SSE__)
+	leafBatch = TRIANGLE_GROUP_WIDTH;		// A group of triangles costs about one scalar test
+#endif
 }
 
 SceneBvh::~SceneBvh() {
-	delete[] bvhNodes;
+	ReleaseCache();
 	delete[] triangles;
+	delete[] accelTriangles;
+	delete[] wideNodes;
+	delete[] triangleGroups;
+	delete[] leafGroups;
 }
 
 bool SceneBvh::BuildBvh() {
@@ -37,17 +113,99 @@ bool SceneBvh::BuildBvh() {
 	if(numTris == 0) {
 		return false;
 	}
-	BvhNode &root = bvhNodes[rootIdx];
-	root.left = 0;
-	root.firstTriangle = 0;
-	root.triangleCount = numTris;
 
-	CalcBounds(rootIdx);
-	Subdivide(rootIdx);
+	uint64_t hash = 0;
+	if(!cacheDir.empty()) {
+		hash = GeometryHash();
+		if(LoadCache(hash)) {
+			BuildTriangleGroups();
+			return true;
+		}
+	}
+
+	BeginBuild(numTris);
+
+	#pragma omp parallel for
+	for(int i = 0; i < numTris; i++) {
+		Triangle &triangle = triangles[i];
+		centroids[i] = (triangle.v1 + triangle.v2 + triangle.v3) * 0.333333f;
+		primBounds[i].Clear();
+		primBounds[i].AddPoint(triangle.v1);
+		primBounds[i].AddPoint(triangle.v2);
+		primBounds[i].AddPoint(triangle.v3);
+	}
+
+	BuildTree();
+	ReorderTriangles();
+	if(!cacheDir.empty()) {
+		SaveCache(hash);
+	}
+	EndBuild();
+	BuildTriangleGroups();
 
 	return true;
 }
 
+// Leaves index into the triangle arrays directly, so put them in tree order
+void SceneBvh::ReorderTriangles() {
+	Triangle *sorted = new Triangle[numTris];
+	accelTriangles = new AccelTriangle[numTris];
+
+	#pragma omp parallel for
+	for(int i = 0; i < numTris; i++) {
+		Triangle &triangle = triangles[primIdx[i]];
+		sorted[i] = triangle;
+		accelTriangles[i].v1 = triangle.v1;
+		accelTriangles[i].e1 = triangle.v2 - triangle.v1;
+		accelTriangles[i].e2 = triangle.v3 - triangle.v1;
+	}
+
+	delete[] triangles;
+	triangles = sorted;
+}
+
+// Packs every leaf into groups of TRIANGLE_GROUP_WIDTH for IntersectLeaf, a leaf's groups side by side
+void SceneBvh::BuildTriangleGroups() {
+	delete[] triangleGroups;
+	delete[] leafGroups;
+	leafGroups = new uint[numTris];
+
+	uint groupCount = 0;
+	for(uint n = 0; n < nodesUsed; n++) {
+		const BvhNode &node = bvhNodes[n];
+		if(node.triangleCount > 0) {
+			leafGroups[node.firstTriangle] = groupCount;
+			groupCount += (node.triangleCount + TRIANGLE_GROUP_WIDTH - 1) / TRIANGLE_GROUP_WIDTH;
+		}
+	}
+
+	triangleGroups = new TriangleGroup[groupCount]();		// Zeroed, so spare lanes stay degenerate
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for(uint n = 0; n < nodesUsed; n++) {
+		const BvhNode &node = bvhNodes[n];
+		for(uint k = 0; k < node.triangleCount; k++) {
+			const AccelTriangle &triangle = accelTriangles[node.firstTriangle + k];
+			TriangleGroup &group = triangleGroups[leafGroups[node.firstTriangle] + k / TRIANGLE_GROUP_WIDTH];
+			int lane = k % TRIANGLE_GROUP_WIDTH;
+			group.v1x[lane] = triangle.v1.x;
+			group.v1y[lane] = triangle.v1.y;
+			group.v1z[lane] = triangle.v1.z;
+			group.e1x[lane] = triangle.e1.x;
+			group.e1y[lane] = triangle.e1.y;
+			group.e1z[lane] = triangle.e1.z;
+			group.e2x[lane] = triangle.e2.x;
+			group.e2y[lane] = triangle.e2.y;
+			group.e2z[lane] = triangle.e2.z;
+		}
+	}
+}
+
+void BoundBoxf::Clear() {
+	min = Vec3f(GIANT_NUM, GIANT_NUM, GIANT_NUM);
+	max = Vec3f(-GIANT_NUM, -GIANT_NUM, -GIANT_NUM);
+}
+
 void BoundBoxf::AddPoint(Vec3f p) {
 	if(p.x < min.x) {
 		min.x = p.x;
@@ -69,81 +227,341 @@ void BoundBoxf::AddPoint(Vec3f p) {
 	}
 }
 
-void SceneBvh::CalcBounds(uint nodeIdx) {
+// Component-wise, so merging an empty (cleared) box changes nothing
+void BoundBoxf::AddBox(const BoundBoxf &box) {
+	min = Vec3f(std::min(min.x, box.min.x), std::min(min.y, box.min.y), std::min(min.z, box.min.z));
+	max = Vec3f(std::max(max.x, box.max.x), std::max(max.y, box.max.y), std::max(max.z, box.max.z));
+}
+
+// Surface area, zero for an empty box
+float BoundBoxf::Area() const {
+	Vec3f extent = max - min;
+	if(extent.x < 0 || extent.y < 0 || extent.z < 0) {
+		return 0.f;
+	}
+
+	return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static inline float AxisOf(const Vec3f &v, int axis) {
+	return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+// Number of fixed-size blocks a large node is cut into for taskloops
+static inline int BlockCount(int count) {
+	return (count + PARALLEL_BLOCK_SIZE - 1) / PARALLEL_BLOCK_SIZE;
+}
+
+// Taskloops only pay off on big nodes, and not at all with one thread
+bool BvhTree::BinInParallel(int count) {
+	return parallelBuild && count >= PARALLEL_SPLIT_THRESHOLD;
+}
+
+void BvhTree::CalcBounds(uint nodeIdx) {
 	BvhNode &node = bvhNodes[nodeIdx];
-	node.bounds.min = Vec3f(GIANT_NUM, GIANT_NUM, GIANT_NUM);
-	node.bounds.max = Vec3f(-GIANT_NUM, -GIANT_NUM, -GIANT_NUM);
 	uint first = node.firstTriangle;
-	for(int i = 0; i < node.triangleCount; i++) {
-		Triangle &triangle = triangles[first + i];
-		node.bounds.AddPoint(triangle.v1);
-		node.bounds.AddPoint(triangle.v2);
-		node.bounds.AddPoint(triangle.v3);
+	int count = node.triangleCount;
+	BoundBoxf bounds;
+	bounds.Clear();
+
+	if(!BinInParallel(count)) {
+		for(int i = 0; i < count; i++) {
+			bounds.AddBox(primBounds[primIdx[first + i]]);
+		}
+	}
+	else {
+		#pragma omp taskloop grainsize(1) shared(bounds)
+		for(int b = 0; b < BlockCount(count); b++) {
+			BoundBoxf local;
+			local.Clear();
+			int end = std::min(count, (b + 1) * PARALLEL_BLOCK_SIZE);
+			for(int i = b * PARALLEL_BLOCK_SIZE; i < end; i++) {
+				local.AddBox(primBounds[primIdx[first + i]]);
+			}
+
+			#pragma omp critical(bvhBuildMerge)
+			bounds.AddBox(local);
+		}
 	}
 
 	// Inflate bounding box
-	node.bounds.min = node.bounds.min - Vec3f(PADDING, PADDING, PADDING);
-	node.bounds.max = node.bounds.max + Vec3f(PADDING, PADDING, PADDING);
+	node.bounds.min = bounds.min - Vec3f(PADDING, PADDING, PADDING);
+	node.bounds.max = bounds.max + Vec3f(PADDING, PADDING, PADDING);
 }
 
-void SceneBvh::Subdivide(uint nodeIdx) {
-	BvhNode &node = bvhNodes[nodeIdx];
+struct BvhBin {
+	BoundBoxf bounds;
+	int count;
+};
 
-	if(node.triangleCount <= 3) {		// Stop when there are at least two faces (you often can't split further)
-		return;
+// Drop the index range [begin, end) into per-axis bins
+void BvhTree::FillBins(uint begin, uint end, const BoundBoxf &centroidBounds, const float *scale, BvhBin bins[3][MAX_SAH_BINS]) {
+	for(int a = 0; a < 3; a++) {
+		for(int b = 0; b < binCount; b++) {
+			bins[a][b].bounds.Clear();
+			bins[a][b].count = 0;
+		}
+	}
+
+	for(uint i = begin; i < end; i++) {
+		uint idx = primIdx[i];
+		for(int a = 0; a < 3; a++) {
+			if(scale[a] == 0.f) {
+				continue;
+			}
+			int binIdx = std::min(binCount - 1, (int) ((AxisOf(centroids[idx], a) - AxisOf(centroidBounds.min, a)) * scale[a]));
+			bins[a][binIdx].count++;
+			bins[a][binIdx].bounds.AddBox(primBounds[idx]);
+		}
 	}
+}
+
+// Bin the centroids along each axis and sweep the bin boundaries for the cheapest split
+// Returns the SAH cost of that split, or GIANT_NUM if nothing can be split
+float BvhTree::FindBestSplitPlane(BvhNode &node, int &axis, float &splitPos) {
+	uint first = node.firstTriangle;
+	int count = node.triangleCount;
+	bool parallel = BinInParallel(count);
+
+	// Bins are laid over the centroid bounds, not the node bounds
+	BoundBoxf centroidBounds;
+	centroidBounds.Clear();
+	if(!parallel) {
+		for(int i = 0; i < count; i++) {
+			centroidBounds.AddPoint(centroids[primIdx[first + i]]);
+		}
+	}
+	else {
+		#pragma omp taskloop grainsize(1) shared(centroidBounds)
+		for(int b = 0; b < BlockCount(count); b++) {
+			BoundBoxf local;
+			local.Clear();
+			int end = std::min(count, (b + 1) * PARALLEL_BLOCK_SIZE);
+			for(int i = b * PARALLEL_BLOCK_SIZE; i < end; i++) {
+				local.AddPoint(centroids[primIdx[first + i]]);
+			}
 
-	// Find greatest axis and split down the center
+			#pragma omp critical(bvhBuildMerge)
+			centroidBounds.AddBox(local);
+		}
+	}
+
+	float scale[3];
+	for(int a = 0; a < 3; a++) {
+		float extent = AxisOf(centroidBounds.max, a) - AxisOf(centroidBounds.min, a);
+		scale[a] = (extent > 0.f) ? binCount / extent : 0.f;		// Zero means flat along this axis
+	}
+
+	BvhBin bins[3][MAX_SAH_BINS];
+	if(!parallel) {
+		FillBins(first, first + count, centroidBounds, scale, bins);
+	}
+	else {
+		for(int a = 0; a < 3; a++) {
+			for(int b = 0; b < binCount; b++) {
+				bins[a][b].bounds.Clear();
+				bins[a][b].count = 0;
+			}
+		}
+
+		#pragma omp taskloop grainsize(1) shared(bins, centroidBounds, scale)
+		for(int b = 0; b < BlockCount(count); b++) {
+			BvhBin local[3][MAX_SAH_BINS];
+			uint end = first + std::min(count, (b + 1) * PARALLEL_BLOCK_SIZE);
+			FillBins(first + b * PARALLEL_BLOCK_SIZE, end, centroidBounds, scale, local);
+
+			#pragma omp critical(bvhBuildMerge)
+			for(int a = 0; a < 3; a++) {
+				for(int k = 0; k < binCount; k++) {
+					bins[a][k].count += local[a][k].count;
+					bins[a][k].bounds.AddBox(local[a][k].bounds);
+				}
+			}
+		}
+	}
+
+	float bestCost = GIANT_NUM;
+	float nodeArea = node.bounds.Area();
+	axis = -1;
+
+	for(int a = 0; a < 3; a++) {
+		if(scale[a] == 0.f) {
+			continue;
+		}
+
+		// Sweep from both ends to get the areas and counts on either side of each plane
+		float leftArea[MAX_SAH_BINS - 1], rightArea[MAX_SAH_BINS - 1];
+		int leftCount[MAX_SAH_BINS - 1], rightCount[MAX_SAH_BINS - 1];
+		BoundBoxf leftBox, rightBox;
+		leftBox.Clear();
+		rightBox.Clear();
+		int leftSum = 0, rightSum = 0;
+		for(int b = 0; b < binCount - 1; b++) {
+			leftSum += bins[a][b].count;
+			leftBox.AddBox(bins[a][b].bounds);
+			leftCount[b] = leftSum;
+			leftArea[b] = leftBox.Area();
+
+			rightSum += bins[a][binCount - 1 - b].count;
+			rightBox.AddBox(bins[a][binCount - 1 - b].bounds);
+			rightCount[binCount - 2 - b] = rightSum;
+			rightArea[binCount - 2 - b] = rightBox.Area();
+		}
+
+		float binWidth = 1.f / scale[a];
+		for(int b = 0; b < binCount - 1; b++) {
+			if(leftCount[b] == 0 || rightCount[b] == 0) {
+				continue;
+			}
+
+			float cost = SAH_TRAVERSAL_COST * nodeArea + SAH_INTERSECT_COST * (LeafTests(leftCount[b]) * leftArea[b] + LeafTests(rightCount[b]) * rightArea[b]);
+			if(cost < bestCost) {
+				bestCost = cost;
+				axis = a;
+				splitPos = AxisOf(centroidBounds.min, a) + binWidth * (b + 1);
+			}
+		}
+	}
+
+	return bestCost;
+}
+
+// Find greatest axis and split down the center
+float BvhTree::FindMidpointSplitPlane(BvhNode &node, int &axis, float &splitPos) {
 	Vec3f extent = node.bounds.max - node.bounds.min;
-	float splitPos;
-	int axis = 0;
+	axis = 0;
 	if(extent.y > extent.x && extent.y > extent.z) {
 		axis = 1;
-		splitPos = node.bounds.min.y + extent.y * 0.5f;
 	}
 	else if(extent.z > extent.x && extent.z > extent.y) {
 		axis = 2;
-		splitPos = node.bounds.min.z + extent.z * 0.5f;
 	}
-	else {
-		splitPos = node.bounds.min.x + extent.x * 0.5f;
+	splitPos = AxisOf(node.bounds.min, axis) + AxisOf(extent, axis) * 0.5f;
+
+	return 0.f;
+}
+
+// Partition of the index range around splitPos
+// Returns the first index of the right half
+uint BvhTree::Partition(BvhNode &node, int axis, float splitPos) {
+	uint first = node.firstTriangle;
+	int count = node.triangleCount;
+
+	if(!BinInParallel(count)) {		// Hoare-style, in place
+		int i = first;
+		int j = i + count - 1;
+
+		while(i <= j) {
+			if(AxisOf(centroids[primIdx[i]], axis) < splitPos) {
+				i++;
+			}
+			else {
+				std::swap(primIdx[i], primIdx[j--]);
+			}
+		}
+
+		return i;
 	}
-	
-	// Lomuto partition this
-	int i = node.firstTriangle;
-	int j = i + node.triangleCount - 1;
 
-	while(i <= j) {
-		Triangle triangle = triangles[i];
-		float centroidAxis;
-		if(axis = 0) {
-			centroidAxis = (triangle.v1.x + triangle.v2.x + triangle.v3.x) * 0.333333f;
+	// Count each block's left side, prefix sum the counts, then scatter through the scratch list
+	int numBlocks = BlockCount(count);
+	std::vector<uint> leftOffset(numBlocks + 1, 0);
+	std::vector<uint> rightOffset(numBlocks + 1, 0);
+
+	#pragma omp taskloop grainsize(1) shared(leftOffset, rightOffset)
+	for(int b = 0; b < numBlocks; b++) {
+		int end = std::min(count, (b + 1) * PARALLEL_BLOCK_SIZE);
+		uint left = 0;
+		for(int i = b * PARALLEL_BLOCK_SIZE; i < end; i++) {
+			if(AxisOf(centroids[primIdx[first + i]], axis) < splitPos) {
+				left++;
+			}
 		}
-		else if(axis = 1) {
-			centroidAxis = (triangle.v1.y + triangle.v2.y + triangle.v3.y) * 0.333333f;
+		leftOffset[b + 1] = left;
+		rightOffset[b + 1] = (end - b * PARALLEL_BLOCK_SIZE) - left;
+	}
+
+	for(int b = 0; b < numBlocks; b++) {
+		leftOffset[b + 1] += leftOffset[b];
+		rightOffset[b + 1] += rightOffset[b];
+	}
+	uint leftTotal = leftOffset[numBlocks];
+
+	#pragma omp taskloop grainsize(1) shared(leftOffset, rightOffset)
+	for(int b = 0; b < numBlocks; b++) {
+		int end = std::min(count, (b + 1) * PARALLEL_BLOCK_SIZE);
+		uint left = first + leftOffset[b];
+		uint right = first + leftTotal + rightOffset[b];
+		for(int i = b * PARALLEL_BLOCK_SIZE; i < end; i++) {
+			uint idx = primIdx[first + i];
+			if(AxisOf(centroids[idx], axis) < splitPos) {
+				scratchIdx[left++] = idx;
+			}
+			else {
+				scratchIdx[right++] = idx;
+			}
+		}
+	}
+
+	#pragma omp taskloop grainsize(1)
+	for(int b = 0; b < numBlocks; b++) {
+		int end = std::min(count, (b + 1) * PARALLEL_BLOCK_SIZE);
+		for(int i = b * PARALLEL_BLOCK_SIZE; i < end; i++) {
+			primIdx[first + i] = scratchIdx[first + i];
+		}
+	}
+
+	return first + leftTotal;
+}
+
+// Root is depth 0
+void BvhTree::Subdivide(uint nodeIdx, int depth) {
+	BvhNode &node = bvhNodes[nodeIdx];
+	if(depth >= MAX_BVH_DEPTH) {
+		return;
+	}
+
+	int axis;
+	float splitPos;
+	if(buildMode == BVH_BUILD_MIDPOINT) {
+		if(node.triangleCount <= MIDPOINT_LEAF_SIZE) {		// Stop when there are at least two faces (you often can't split further)
+			return;
 		}
-		else if(axis = 2) {
-			centroidAxis = (triangle.v1.z + triangle.v2.z + triangle.v3.z) * 0.333333f;
+		FindMidpointSplitPlane(node, axis, splitPos);
+	}
+	else {
+		if(node.triangleCount <= 1) {
+			return;
 		}
 
-		if(centroidAxis < splitPos) {
-			i++;
+		float splitCost = FindBestSplitPlane(node, axis, splitPos);
+		if(axis < 0) {		// Every centroid in the same spot
+			return;
 		}
-		else {
-			triangles[i] = triangles[j];
-			triangles[j--] = triangle;
+
+		// Splitting has to pay for itself, unless the leaf would be huge
+		float leafCost = SAH_INTERSECT_COST * LeafTests(node.triangleCount) * node.bounds.Area();
+		if(splitCost >= leafCost && node.triangleCount <= MAX_LEAF_TRIANGLES) {
+			return;
 		}
-		
-	};
-	
+	}
+
+	uint i = Partition(node, axis, splitPos);
+
 	int leftCount = i - node.firstTriangle;
 	if(leftCount == 0 || leftCount == node.triangleCount) {	// Rare empty box?
 		return;
 	}
 
-	// Create child nodes
-	int leftIdx = nodesUsed++;
-	int rightIdx = nodesUsed++;
+	// Create child nodes, side by side so RayBvh can find the right one at left + 1
+	uint leftIdx;
+	#pragma omp atomic capture
+	{
+		leftIdx = nodesUsed;
+		nodesUsed += 2;
+	}
+	uint rightIdx = leftIdx + 1;
+
 	bvhNodes[leftIdx].firstTriangle = node.firstTriangle;
 	bvhNodes[leftIdx].triangleCount = leftCount;
 	bvhNodes[rightIdx].firstTriangle = i;
@@ -153,75 +571,42 @@ void SceneBvh::Subdivide(uint nodeIdx) {
 	CalcBounds(leftIdx);
 	CalcBounds(rightIdx);
 
-	// Recurse
-	Subdivide(leftIdx);
-	Subdivide(rightIdx);
+	// Recurse, handing big subtrees to other threads
+	#pragma omp task if(bvhNodes[leftIdx].triangleCount >= PARALLEL_TASK_THRESHOLD)
+	Subdivide(leftIdx, depth + 1);
+
+	Subdivide(rightIdx, depth + 1);
 }
 
-// Slab method hit check
-// This does not return a hit point
-bool HitCheckBoundingBox(Vec3f start, Vec3f dir, BoundBoxf boundingBox) {
-	float tMin = (boundingBox.min.x - start.x) / dir.x;
-	float tMax = (boundingBox.max.x - start.x) / dir.x;
-	if(tMin > tMax) {
-		float temp  = tMin;
-		tMin = tMax;
-		tMax  = temp;
+// Closest hit, nearer child first. The wide tree takes over once it exists
+bool SceneBvh::RayBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &triHit, float &u, float &v) {
+	if(wideNodes) {
+		return RayWideBvh(start, dir, tMax, tHit, triHit, u, v);
 	}
 
-	float tyMin = (boundingBox.min.y - start.y) / dir.y;
-	float tyMax = (boundingBox.max.y - start.y) / dir.y;
-	if(tyMin > tyMax) {
-		float temp  = tyMin;
-		tyMin = tyMax;
-		tyMax = temp;
-	}
+	int hitIdx = -1;
+	TraverseClosest(start, dir, tMax, [&](uint first, uint count, float &tClosest) {
+		IntersectLeaf(start, dir, first, count, tClosest, u, v, hitIdx);
+	});
 
-	if((tMin > tyMax) || (tyMin > tMax)) {
+	if(hitIdx < 0) {
 		return false;
 	}
 
-	if(tyMin > tMin) {
-		tMin = tyMin;
-	}
-	if(tyMax < tMax) {
-		tMax = tyMax;
-	}
-
-	float tzMin = (boundingBox.min.z - start.z) / dir.z;
-	float tzMax = (boundingBox.max.z - start.z) / dir.z;
-	if(tzMin > tzMax) {
-		float temp  = tzMin;
-		tzMin = tzMax;
-		tzMax = temp;
-	}
+	tHit = tMax;
+	triHit = hitIdx;
 
-	return !((tMin > tzMax) || (tzMin > tMax));
+	return true;
 }
 
-// Recursive hit routine on Bvh
-bool SceneBvh::RayBvh(Vec3f start, Vec3f dir, const uint nodeIdx, float tMax, float &tHit, Triangle &triHit, float &u, float &v) {
-	bool hit = false;
-	BvhNode &node = bvhNodes[nodeIdx];
-	if(!HitCheckBoundingBox(start, dir, node.bounds)) {		// Missed
-		return false;
-	}
-	if(node.triangleCount > 0) {		// In a leaf		
-		for(int i = 0; i < node.triangleCount; i++) {
-			if(HitCheckTriangle(start, dir, triangles[node.firstTriangle + i], tMax, tHit, u, v)) {
-				if(!(tHit < RAY_EPS)) {
-					triHit = triangles[node.firstTriangle + i];
-					hit = true;
-					tMax = tHit;
-				}
-			}
-		}
-	}
-	else {
-		hit |= RayBvh(start, dir, node.left, tMax, tHit, triHit, u, v);
-		hit |= RayBvh(start, dir, node.left + 1, tMax, tHit, triHit, u, v);
+// Any-hit traversal for shadow rays
+// Stops at the first triangle in [RAY_EPS, tMax]
+bool SceneBvh::OccludedBvh(Vec3f start, Vec3f dir, float tMax) {
+	if(wideNodes) {
+		return OccludedWideBvh(start, dir, tMax);
 	}
 
-	return hit;
+	return TraverseAny(start, dir, tMax, [&](uint first, uint count) {
+		return OccludedLeaf(start, dir, first, count, tMax);
+	});
 }
-
@@ -4,13 +4,45 @@
 #include "ScenePrimitives.h"
 
 #include <vector>
+#include <string>
+#include <stdint.h>
+
+#define SAH_BIN_COUNT 16		// Default bins per axis for the SAH builder
+#define MAX_SAH_BINS 64
+
+#define BVH_STACK_SIZE 64		// Traversals keep at most one entry per level on their stacks
+#define MAX_BVH_DEPTH (BVH_STACK_SIZE - 1)		// The builders make a leaf here however many primitives are left, so no tree outgrows the stacks
+
+#define FNV_OFFSET 14695981039346656037ull
+
+// FNV-1a, start from FNV_OFFSET. Keys the tree cache and the distributed render handshake
+uint64_t HashBytes(uint64_t hash, const void *data, size_t size);
+
+// How the tree gets split
+enum BvhBuildMode {
+	BVH_BUILD_SAH,			// Binned surface area heuristic, the default
+	BVH_BUILD_MIDPOINT,		// Spatial midpoint of the longest axis. Builds fast, traces slow
+	BVH_BUILD_LBVH			// Morton order of the centroids, see LinearBvh.cpp. Fastest to build, for previews
+};
 
 struct BoundBoxf {
+	void Clear();
 	void AddPoint(Vec3f p);
+	void AddBox(const BoundBoxf &box);
+	float Area() const;
 
 	Vec3f min, max;
 };
 
+struct BvhBin;
+
+// Just what the intersection test reads, precomputed once the tree is built
+// Normals, planes and materials stay in SceneBvh::triangles until a hit is known
+struct AccelTriangle {
+	Vertex v1;
+	Vec3f e1, e2;		// v2 - v1, v3 - v1
+};
+
 // Size-optimized a bit
 struct BvhNode {
 	BoundBoxf bounds;
@@ -20,24 +52,146 @@ struct BvhNode {
 	uint firstTriangle, triangleCount;
 };
 
-class SceneBvh {
+#define WIDE_BVH_WIDTH 4
+
+// Four children per node, bounds stored axis by axis so one SSE slab test covers all of them
+// A child with count > 0 is a leaf starting at triangle child[i], otherwise child[i] is a node index
+struct alignas(16) WideBvhNode {
+	float minX[WIDE_BVH_WIDTH], minY[WIDE_BVH_WIDTH], minZ[WIDE_BVH_WIDTH];
+	float maxX[WIDE_BVH_WIDTH], maxY[WIDE_BVH_WIDTH], maxZ[WIDE_BVH_WIDTH];
+	uint child[WIDE_BVH_WIDTH];
+	uint count[WIDE_BVH_WIDTH];
+};
+
+#define TRIANGLE_GROUP_WIDTH 4
+
+// Up to four triangles of one leaf, stored axis by axis so one SSE Möller-Trumbore test covers all of them
+// Lanes past the end of the leaf are zero-sized and never hit
+struct alignas(16) TriangleGroup {
+	float v1x[TRIANGLE_GROUP_WIDTH], v1y[TRIANGLE_GROUP_WIDTH], v1z[TRIANGLE_GROUP_WIDTH];
+	float e1x[TRIANGLE_GROUP_WIDTH], e1y[TRIANGLE_GROUP_WIDTH], e1z[TRIANGLE_GROUP_WIDTH];
+	float e2x[TRIANGLE_GROUP_WIDTH], e2y[TRIANGLE_GROUP_WIDTH], e2z[TRIANGLE_GROUP_WIDTH];
+};
+
+#define RAY_PACKET_SIDE 4		// Packets are square blocks of camera rays
+#define RAY_PACKET_SIZE (RAY_PACKET_SIDE * RAY_PACKET_SIDE)
+
+// Rays traced through the tree together, stored axis by axis for the SIMD lanes
+struct alignas(16) RayPacket {
+	float startX[RAY_PACKET_SIZE], startY[RAY_PACKET_SIZE], startZ[RAY_PACKET_SIZE];
+	float dirX[RAY_PACKET_SIZE], dirY[RAY_PACKET_SIZE], dirZ[RAY_PACKET_SIZE];
+	int count;		// Rays past count are left alone
+};
+
+// Closest triangle found ahead of shading, triangle is -1 on a miss
+struct TriangleHit {
+	float t, u, v;
+	int triangle;
+};
+
+// The node array and the builders, independent of what the leaves hold
+// firstTriangle/triangleCount index whatever primitive the derived tree stores
+class BvhTree {
+public:
+	BvhTree() {}
+	~BvhTree();
+
+	void CalcBounds(uint nodeIdx);
+	void Subdivide(uint nodeIdx, int depth);
+
+	uint rootIdx = 0;
+	uint nodesUsed = 1;
+	BvhNode *bvhNodes = NULL;
+
+	BvhBuildMode buildMode = BVH_BUILD_SAH;
+	int binCount = SAH_BIN_COUNT;
+	int leafBatch = 1;		// Primitives a leaf tests at once, the SAH prices leaves per batch
+
+protected:
+	// Traversals shared by the trees, defined in BvhIntersect.h. Leaves are handed over as (first, count)
+	// Closest hit: leaf(first, count, tMax) tests its primitives and lowers tMax to any closer hit
+	template<typename LeafTest> void TraverseClosest(const Vec3f &start, const Vec3f &dir, float &tMax, LeafTest leaf);
+	// Any hit: leaf(first, count) returns true once something blocks the ray
+	template<typename LeafTest> bool TraverseAny(const Vec3f &start, const Vec3f &dir, float tMax, LeafTest leaf);
+
+	void BeginBuild(int count);
+	void BuildTree();
+	void EndBuild();
+
+	// Only alive between BeginBuild and EndBuild
+	int			primCount = 0;
+	uint		*primIdx = NULL;
+	uint		*scratchIdx = NULL;
+	Vec3f		*centroids = NULL;
+	BoundBoxf	*primBounds = NULL;
+	std::vector<uint64_t> mortonCodes;		// LBVH only, in primIdx order
+
+private:
+	void BuildLinear();
+	void EmitLinear(uint nodeIdx, int depth);
+
+	void FillBins(uint begin, uint end, const BoundBoxf &centroidBounds, const float *scale, BvhBin bins[3][MAX_SAH_BINS]);
+	float FindBestSplitPlane(BvhNode &node, int &axis, float &splitPos);
+	float FindMidpointSplitPlane(BvhNode &node, int &axis, float &splitPos);
+	uint Partition(BvhNode &node, int axis, float splitPos);
+	bool BinInParallel(int count);
+	int LeafTests(int count) const { return (count + leafBatch - 1) / leafBatch; }
+
+	bool		parallelBuild = false;
+};
+
+class SceneBvh : public BvhTree {
 public:
 	SceneBvh() {}
 	~SceneBvh();
 
-	SceneBvh(std::vector<Triangle> inputTriangles);
+	SceneBvh(const std::vector<Triangle> &inputTriangles);
 
 	bool BuildBvh();
-	void CalcBounds(uint nodeIdx);
-	void Subdivide(uint nodeIdx);
 
-	bool RayBvh(Vec3f start, Vec3f dir, const uint nodeIdx, float tMax, float &tHit, Triangle &triHit, float &u, float &v);
+	bool RayBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &triHit, float &u, float &v);
+	bool OccludedBvh(Vec3f start, Vec3f dir, float tMax);
+
+	// Optional 4-wide tree, collapsed from the binary one. Traversal switches over once it exists
+	void CollapseWide();
+	bool RayWideBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &triHit, float &u, float &v);
+	bool OccludedWideBvh(Vec3f start, Vec3f dir, float tMax);
+
+	// Same hits as RayBvh for every ray of the packet, up to which of two equally close triangles wins
+	// Packets whose rays don't all point into the same octant go ray by ray
+	void RayPacketBvh(const RayPacket &packet, float tMax, TriangleHit *hits);
+
+	// Set before BuildBvh to reuse trees across runs, keyed by a hash of the geometry
+	std::string cacheDir;
 
 	int		numTris;
-	Triangle	*triangles = NULL;
-	uint rootIdx = 0;
-	uint nodesUsed = 1;
-	BvhNode *bvhNodes = NULL;
+	Triangle	*triangles = NULL;			// Full triangles for shading, in tree order
+	AccelTriangle	*accelTriangles = NULL;	// Same order, for traversal
+	uint wideNodesUsed = 0;
+	WideBvhNode *wideNodes = NULL;
+
+	// Leaf triangles in groups for the SIMD test, built along with the tree
+	TriangleGroup *triangleGroups = NULL;
+	uint *leafGroups = NULL;		// First group of the leaf that starts at each triangle
+
+private:
+	void ReorderTriangles();
+	void BuildTriangleGroups();
+
+	// Leaf tests shared by the traversals, see BvhIntersect.h
+	inline void IntersectLeaf(const Vec3f &start, const Vec3f &dir, uint first, uint count, float &tMax, float &u, float &v, int &hitIdx);
+	inline bool OccludedLeaf(const Vec3f &start, const Vec3f &dir, uint first, uint count, float tMax);
+	void CollapseNode(uint nodeIdx, uint wideIdx);
+
+	uint64_t GeometryHash();
+	std::string CachePath(uint64_t hash);
+	bool LoadCache(uint64_t hash);
+	void SaveCache(uint64_t hash);
+	void ReleaseCache();
+
+	// Nodes and accelTriangles point in here when the tree came from the cache
+	void *cacheMapping = NULL;
+	size_t cacheMappingSize = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,229 @@
+#include "Bvh.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include <fcntl.h>		// POSIX file mapping
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BVH_CACHE_MAGIC "RTBVHC1"		// Bump when BvhNode, AccelTriangle or the builders change
+
+#define FNV_PRIME 1099511628211ull
+
+// Sits at the front of the cache file
+// Followed by the nodes, the traversal triangles and the original index of every triangle, all in tree order
+struct BvhCacheHeader {
+	char magic[8];
+	uint64_t hash;
+	uint32_t numTris;
+	uint32_t nodesUsed;
+	uint32_t nodeSize, accelSize;		// Catches layout changes the magic forgot about
+	uint32_t pad[2];
+};
+
+uint64_t HashBytes(uint64_t hash, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *) data;
+	for(size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+// FNV-1a over the vertices and the build settings
+// Materials and normals are left out, they do not change the tree
+uint64_t SceneBvh::GeometryHash() {
+	uint64_t hash = FNV_OFFSET;
+	hash = HashBytes(hash, &numTris, sizeof(numTris));
+	hash = HashBytes(hash, &buildMode, sizeof(buildMode));
+	hash = HashBytes(hash, &binCount, sizeof(binCount));
+	hash = HashBytes(hash, &leafBatch, sizeof(leafBatch));
+	for(int i = 0; i < numTris; i++) {
+		Triangle &triangle = triangles[i];
+		float v[9] = {	triangle.v1.x, triangle.v1.y, triangle.v1.z,
+						triangle.v2.x, triangle.v2.y, triangle.v2.z,
+						triangle.v3.x, triangle.v3.y, triangle.v3.z	};
+		hash = HashBytes(hash, v, sizeof(v));
+	}
+
+	return hash;
+}
+
+std::string SceneBvh::CachePath(uint64_t hash) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long) hash);
+
+	return cacheDir + "/" + name;
+}
+
+static size_t CacheFileSize(uint32_t numTris, uint32_t nodesUsed) {
+	return sizeof(BvhCacheHeader) + nodesUsed * sizeof(BvhNode) + numTris * sizeof(AccelTriangle) + numTris * sizeof(uint32_t);
+}
+
+// The mapped file is only trusted once traversal and BuildTriangleGroups can't leave the arrays through it:
+// children come after their parent and inside the node array, no leaf is deeper than MAX_BVH_DEPTH,
+// the leaves cover every triangle exactly once and order is a permutation
+static bool ValidCache(const BvhNode *nodes, uint32_t nodesUsed, const uint32_t *order, uint32_t numTris) {
+	if(nodesUsed == 0) {
+		return false;
+	}
+
+	std::vector<char> seen(numTris, 0);
+	std::vector<int> depth(nodesUsed, 0);		// Parents come first, so a node's depth is final once it is reached
+	uint64_t covered = 0;
+	for(uint32_t n = 0; n < nodesUsed; n++) {
+		const BvhNode &node = nodes[n];
+		if(node.triangleCount > 0) {
+			if((uint64_t) node.firstTriangle + node.triangleCount > numTris) {
+				return false;
+			}
+			for(uint32_t i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++) {
+				if(seen[i]) {
+					return false;
+				}
+				seen[i] = 1;
+			}
+			covered += node.triangleCount;
+		}
+		else if(node.left <= n || (uint64_t) node.left + 1 >= nodesUsed || depth[n] >= MAX_BVH_DEPTH) {
+			return false;
+		}
+		else {
+			depth[node.left] = std::max(depth[node.left], depth[n] + 1);
+			depth[node.left + 1] = std::max(depth[node.left + 1], depth[n] + 1);
+		}
+	}
+	if(covered != numTris) {
+		return false;
+	}
+
+	std::fill(seen.begin(), seen.end(), 0);
+	for(uint32_t i = 0; i < numTris; i++) {
+		if(order[i] >= numTris || seen[order[i]]) {
+			return false;
+		}
+		seen[order[i]] = 1;
+	}
+
+	return true;
+}
+
+// Map a matching cache file instead of building
+// Nodes and traversal triangles are used straight from the mapping
+bool SceneBvh::LoadCache(uint64_t hash) {
+	std::string path = CachePath(hash);
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(BvhCacheHeader)) {
+		close(fd);
+		return false;
+	}
+
+	void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);		// The mapping keeps the file alive
+	if(mapping == MAP_FAILED) {
+		return false;
+	}
+
+	BvhCacheHeader *header = (BvhCacheHeader *) mapping;
+	if(strncmp(header->magic, BVH_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->hash != hash || header->numTris != (uint32_t) numTris
+		|| header->nodeSize != sizeof(BvhNode) || header->accelSize != sizeof(AccelTriangle)
+		|| (size_t) info.st_size != CacheFileSize(header->numTris, header->nodesUsed)) {
+		std::cerr << "Ignoring stale BVH cache " << path << std::endl;
+		munmap(mapping, info.st_size);
+		return false;
+	}
+
+	char *data = (char *) mapping + sizeof(BvhCacheHeader);
+	BvhNode *nodes = (BvhNode *) data;
+	data += header->nodesUsed * sizeof(BvhNode);
+	AccelTriangle *accel = (AccelTriangle *) data;
+	data += numTris * sizeof(AccelTriangle);
+	uint32_t *order = (uint32_t *) data;
+
+	if(!ValidCache(nodes, header->nodesUsed, order, numTris)) {
+		std::cerr << "Ignoring corrupt BVH cache " << path << std::endl;
+		munmap(mapping, info.st_size);
+		return false;
+	}
+
+	// Shading data comes from this parse, the cache only decides the order
+	Triangle *sorted = new Triangle[numTris];
+	for(int i = 0; i < numTris; i++) {
+		sorted[i] = triangles[order[i]];
+	}
+	delete[] triangles;
+	triangles = sorted;
+
+	delete[] bvhNodes;
+	bvhNodes = nodes;
+	nodesUsed = header->nodesUsed;
+	accelTriangles = accel;
+	cacheMapping = mapping;
+	cacheMappingSize = info.st_size;
+
+	std::cout << "Loaded BVH from cache " << path << std::endl;
+
+	return true;
+}
+
+// Written to a temporary name first, so a concurrent run never maps half a file
+void SceneBvh::SaveCache(uint64_t hash) {
+	std::string path = CachePath(hash);
+	std::string tempPath = path + ".tmp" + std::to_string(getpid());
+
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if(!file) {
+		std::cerr << "Could not write BVH cache " << tempPath << std::endl;
+		return;
+	}
+
+	BvhCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+	header.hash = hash;
+	header.numTris = numTris;
+	header.nodesUsed = nodesUsed;
+	header.nodeSize = sizeof(BvhNode);
+	header.accelSize = sizeof(AccelTriangle);
+
+	uint32_t *order = new uint32_t[numTris];
+	for(int i = 0; i < numTris; i++) {
+		order[i] = primIdx[i];
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(bvhNodes, sizeof(BvhNode), nodesUsed, file) == nodesUsed;
+	ok = ok && fwrite(accelTriangles, sizeof(AccelTriangle), numTris, file) == (size_t) numTris;
+	ok = ok && fwrite(order, sizeof(uint32_t), numTris, file) == (size_t) numTris;
+	ok = (fclose(file) == 0) && ok;
+	delete[] order;
+
+	if(!ok || rename(tempPath.c_str(), path.c_str()) != 0) {
+		std::cerr << "Could not write BVH cache " << path << std::endl;
+		remove(tempPath.c_str());
+		return;
+	}
+
+	std::cout << "Saved BVH cache " << path << std::endl;
+}
+
+void SceneBvh::ReleaseCache() {
+	if(cacheMapping) {
+		munmap(cacheMapping, cacheMappingSize);
+		cacheMapping = NULL;
+		bvhNodes = NULL;
+		accelTriangles = NULL;
+	}
+}
@@ -0,0 +1,333 @@
+#ifndef BVHINTERSECT_INCLUDED
+#define BVHINTERSECT_INCLUDED
+
+// Ray tests shared by the BVH traversals
+// Only meant for the scene/*.cpp files, so these macros stay out of the renderer
+
+#include "Bvh.h"
+#include "SphereBvh.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>		// SIMD triangle groups
+#endif
+
+#define RAY_EPS 0.003		// Prevents acne. Same as the renderer, so hits it would throw away never shadow farther ones
+#define PLANE_EQUALS_EPS 0.0000001		// For parallel rays
+
+#define GIANT_NUM 1e10f
+
+// Möller-Trumbore test on the precomputed edges
+// Only hits in [RAY_EPS, tMax] count
+static inline bool IntersectTriangle(const Vec3f &start, const Vec3f &dir, const AccelTriangle &triangle, float tMax, float &tHit, float &u, float &v) {
+	Vec3f cross = dir.Cross(triangle.e2);
+	float det = triangle.e1.Dot(cross);
+
+	if(fabs(det) < PLANE_EQUALS_EPS) {		// Parallel
+		return false;
+	}
+
+	float detInverse = 1.f / det;
+
+	Vec3f s = start - triangle.v1;
+	u = detInverse * s.Dot(cross);
+	if(u < 0 || u > 1) {
+		return false;
+	}
+
+	Vec3f cross2 = s.Cross(triangle.e1);
+	v = detInverse * dir.Dot(cross2);
+	if(v < 0 || u + v > 1) {
+		return false;
+	}
+
+	tHit = detInverse * triangle.e2.Dot(cross2);
+
+	return !(tHit < RAY_EPS) && !(tHit > tMax);
+}
+
+// The scalar tests compare floats against double constants. For float x, x < c (double) is x < this
+static inline float FloatBound(double c) {
+	float bound = (float) c;
+	if(bound < c) {
+		bound = nextafterf(bound, GIANT_NUM);
+	}
+
+	return bound;
+}
+
+#if defined(__SSE__)
+// Lanes of a group hit in [RAY_EPS, tMax], with t, u and v for each
+// Same operations in the same order as IntersectTriangle, so every lane agrees with it exactly
+// Not-less/not-greater compares keep its NaN behaviour
+static inline __m128 IntersectGroupLanes(const Vec3f &start, const Vec3f &dir, const TriangleGroup &group, float tMax, __m128 &t, __m128 &u, __m128 &v) {
+	__m128 one = _mm_set1_ps(1.f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+	__m128 e1x = _mm_load_ps(group.e1x), e1y = _mm_load_ps(group.e1y), e1z = _mm_load_ps(group.e1z);
+	__m128 e2x = _mm_load_ps(group.e2x), e2y = _mm_load_ps(group.e2y), e2z = _mm_load_ps(group.e2z);
+
+	__m128 cx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 cy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 cz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, cx), _mm_mul_ps(e1y, cy)), _mm_mul_ps(e1z, cz));
+	__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+	__m128 valid = _mm_cmpnlt_ps(absDet, _mm_set1_ps(FloatBound(PLANE_EQUALS_EPS)));		// Not parallel
+	__m128 detInverse = _mm_div_ps(one, det);
+
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(start.x), _mm_load_ps(group.v1x));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(start.y), _mm_load_ps(group.v1y));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(start.z), _mm_load_ps(group.v1z));
+	u = _mm_mul_ps(detInverse, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, cx), _mm_mul_ps(sy, cy)), _mm_mul_ps(sz, cz)));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+
+	__m128 c2x = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 c2y = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 c2z = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	v = _mm_mul_ps(detInverse, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, c2x), _mm_mul_ps(dy, c2y)), _mm_mul_ps(dz, c2z)));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+
+	t = _mm_mul_ps(detInverse, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, c2x), _mm_mul_ps(e2y, c2y)), _mm_mul_ps(e2z, c2z)));
+	valid = _mm_and_ps(valid, _mm_cmpnlt_ps(t, _mm_set1_ps(FloatBound(RAY_EPS))));
+
+	return _mm_and_ps(valid, _mm_cmpngt_ps(t, _mm_set1_ps(tMax)));
+}
+
+// Closest lane of a group in [RAY_EPS, tMax], or -1
+// Of equally close lanes the last wins, as when the triangles are tested one after another
+static inline int IntersectTriangleGroup(const Vec3f &start, const Vec3f &dir, const TriangleGroup &group, float tMax, float &tHit, float &u, float &v) {
+	__m128 t, uLanes, vLanes;
+	__m128 valid = IntersectGroupLanes(start, dir, group, tMax, t, uLanes, vLanes);
+	int mask = _mm_movemask_ps(valid);
+	if(mask == 0) {
+		return -1;
+	}
+
+	alignas(16) float tLane[TRIANGLE_GROUP_WIDTH], uLane[TRIANGLE_GROUP_WIDTH], vLane[TRIANGLE_GROUP_WIDTH];
+	_mm_store_ps(tLane, t);
+	_mm_store_ps(uLane, uLanes);
+	_mm_store_ps(vLane, vLanes);
+
+	int lane = -1;
+	for(int k = 0; k < TRIANGLE_GROUP_WIDTH; k++) {
+		if(((mask >> k) & 1) && (lane < 0 || !(tLane[k] > tLane[lane]))) {
+			lane = k;
+		}
+	}
+
+	tHit = tLane[lane];
+	u = uLane[lane];
+	v = vLane[lane];
+
+	return lane;
+}
+#endif
+
+// Every triangle of a leaf, narrowing tMax to the closest hit
+inline void SceneBvh::IntersectLeaf(const Vec3f &start, const Vec3f &dir, uint first, uint count, float &tMax, float &u, float &v, int &hitIdx) {
+#if defined(__SSE__)
+	if(triangleGroups) {
+		const TriangleGroup *group = &triangleGroups[leafGroups[first]];
+		for(uint i = first; i < first + count; i += TRIANGLE_GROUP_WIDTH, group++) {
+			float t, uCoord, vCoord;
+			int lane = IntersectTriangleGroup(start, dir, *group, tMax, t, uCoord, vCoord);
+			if(lane >= 0) {
+				tMax = t;
+				u = uCoord;
+				v = vCoord;
+				hitIdx = i + lane;
+			}
+		}
+		return;
+	}
+#endif
+
+	for(uint i = first; i < first + count; i++) {
+		float t, uCoord, vCoord;
+		if(IntersectTriangle(start, dir, accelTriangles[i], tMax, t, uCoord, vCoord)) {
+			tMax = t;
+			u = uCoord;
+			v = vCoord;
+			hitIdx = i;
+		}
+	}
+}
+
+// Any triangle of a leaf in [RAY_EPS, tMax]
+inline bool SceneBvh::OccludedLeaf(const Vec3f &start, const Vec3f &dir, uint first, uint count, float tMax) {
+#if defined(__SSE__)
+	if(triangleGroups) {
+		const TriangleGroup *group = &triangleGroups[leafGroups[first]];
+		for(uint i = first; i < first + count; i += TRIANGLE_GROUP_WIDTH, group++) {
+			__m128 t, u, v;
+			if(_mm_movemask_ps(IntersectGroupLanes(start, dir, *group, tMax, t, u, v)) != 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+#endif
+
+	for(uint i = first; i < first + count; i++) {
+		float t, u, v;
+		if(IntersectTriangle(start, dir, accelTriangles[i], tMax, t, u, v)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Same root choice as HitCheckSphere in the renderer, plus its [RAY_EPS, tMax] range
+static inline bool IntersectSphere(const Vec3f &start, const Vec3f &dir, const AccelSphere &sphere, float tMax, float &tHit) {
+	float a = dir.Dot(dir);
+	Vec3f toStart = start - sphere.origin;
+	float b = 2 * dir.Dot(toStart);
+	float c = toStart.Dot(toStart) - sphere.r * sphere.r;
+
+	float discr = b * b - 4 * a * c;
+	if(discr < 0) {
+		return false;
+	}
+
+	float root = sqrtf(discr);
+	float t0 = (-b + root) / (2 * a);
+	float t1 = (-b - root) / (2 * a);
+	if(!(t0 > 0 || t1 > 0)) {
+		return false;
+	}
+
+	tHit = (t0 < t1) ? t0 : t1;
+
+	return !(tHit < RAY_EPS) && !(tHit > tMax);
+}
+
+// Slab test against the reciprocal ray direction
+// Returns the entry distance, or GIANT_NUM if the box is missed or starts past tMax
+static inline float IntersectBoundingBox(const Vec3f &start, const Vec3f &invDir, const BoundBoxf &box, float tMax) {
+	float tx1 = (box.min.x - start.x) * invDir.x;
+	float tx2 = (box.max.x - start.x) * invDir.x;
+	float tNear = std::min(tx1, tx2);
+	float tFar = std::max(tx1, tx2);
+
+	float ty1 = (box.min.y - start.y) * invDir.y;
+	float ty2 = (box.max.y - start.y) * invDir.y;
+	tNear = std::max(tNear, std::min(ty1, ty2));
+	tFar = std::min(tFar, std::max(ty1, ty2));
+
+	float tz1 = (box.min.z - start.z) * invDir.z;
+	float tz2 = (box.max.z - start.z) * invDir.z;
+	tNear = std::max(tNear, std::min(tz1, tz2));
+	tFar = std::min(tFar, std::max(tz1, tz2));
+
+	if(tFar >= tNear && tNear < tMax && tFar > 0) {
+		return tNear;
+	}
+
+	return GIANT_NUM;
+}
+
+// Closest-hit traversal shared by every binary tree, see Bvh.h
+// The nearer child is visited first, and the farther one is only kept on the stack
+// with its entry distance, so it can be dropped once a closer hit turns up
+template<typename LeafTest>
+inline void BvhTree::TraverseClosest(const Vec3f &start, const Vec3f &dir, float &tMax, LeafTest leaf) {
+	struct StackEntry {
+		uint nodeIdx;
+		float tEntry;
+	};
+
+	Vec3f invDir = Vec3f(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+	if(IntersectBoundingBox(start, invDir, bvhNodes[rootIdx].bounds, tMax) == GIANT_NUM) {
+		return;
+	}
+
+	StackEntry stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	uint nodeIdx = rootIdx;
+
+	while(true) {
+		BvhNode &node = bvhNodes[nodeIdx];
+
+		if(node.triangleCount > 0) {		// In a leaf
+			leaf(node.firstTriangle, node.triangleCount, tMax);
+		}
+		else {
+			uint nearIdx = node.left;
+			uint farIdx = node.left + 1;
+			float tNear = IntersectBoundingBox(start, invDir, bvhNodes[nearIdx].bounds, tMax);
+			float tFar = IntersectBoundingBox(start, invDir, bvhNodes[farIdx].bounds, tMax);
+			if(tFar < tNear) {
+				std::swap(nearIdx, farIdx);
+				std::swap(tNear, tFar);
+			}
+
+			if(tNear != GIANT_NUM) {
+				if(tFar != GIANT_NUM) {
+					stack[stackPtr++] = {farIdx, tFar};
+				}
+				nodeIdx = nearIdx;
+				continue;
+			}
+		}
+
+		// Pop the next node that still lies in front of the closest hit
+		while(stackPtr > 0 && !(stack[stackPtr - 1].tEntry < tMax)) {
+			stackPtr--;
+		}
+		if(stackPtr == 0) {
+			break;
+		}
+		nodeIdx = stack[--stackPtr].nodeIdx;
+	}
+}
+
+// Any-hit traversal for shadow rays
+// Stops at the first leaf that reports a hit, so there is no need to order children
+template<typename LeafTest>
+inline bool BvhTree::TraverseAny(const Vec3f &start, const Vec3f &dir, float tMax, LeafTest leaf) {
+	Vec3f invDir = Vec3f(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+	if(IntersectBoundingBox(start, invDir, bvhNodes[rootIdx].bounds, tMax) == GIANT_NUM) {
+		return false;
+	}
+
+	uint stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	uint nodeIdx = rootIdx;
+
+	while(true) {
+		BvhNode &node = bvhNodes[nodeIdx];
+
+		if(node.triangleCount > 0) {
+			if(leaf(node.firstTriangle, node.triangleCount)) {
+				return true;
+			}
+		}
+		else {
+			bool hitLeft = IntersectBoundingBox(start, invDir, bvhNodes[node.left].bounds, tMax) != GIANT_NUM;
+			bool hitRight = IntersectBoundingBox(start, invDir, bvhNodes[node.left + 1].bounds, tMax) != GIANT_NUM;
+			if(hitLeft) {
+				if(hitRight) {
+					stack[stackPtr++] = node.left + 1;
+				}
+				nodeIdx = node.left;
+				continue;
+			}
+			if(hitRight) {
+				nodeIdx = node.left + 1;
+				continue;
+			}
+		}
+
+		if(stackPtr == 0) {
+			break;
+		}
+		nodeIdx = stack[--stackPtr];
+	}
+
+	return false;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "InstanceBvh.h"
+#include "BvhIntersect.h"
+
+InstanceBvh::InstanceBvh(const std::vector<Instance> &inputInstances, const std::vector<Mesh> &inputMeshes) {
+	meshes = &inputMeshes;
+	numInstances = inputInstances.size();
+	if(numInstances == 0) {
+		return;
+	}
+	instances = new Instance[numInstances];
+
+	for(int i = 0; i < numInstances; i++) {
+		instances[i] = inputInstances[i];
+	}
+}
+
+InstanceBvh::~InstanceBvh() {
+	delete[] instances;
+}
+
+// The mesh trees have to be built first, their root bounds are what gets placed
+bool InstanceBvh::BuildBvh() {
+
+	if(numInstances == 0) {
+		return false;
+	}
+
+	BeginBuild(numInstances);
+
+	for(int i = 0; i < numInstances; i++) {
+		const Instance &instance = instances[i];
+		const SceneBvh *meshBvh = (*meshes)[instance.meshIdx].bvh;
+		const BoundBoxf &local = meshBvh->bvhNodes[meshBvh->rootIdx].bounds;
+
+		primBounds[i].Clear();
+		for(int corner = 0; corner < 8; corner++) {
+			Vec3f p = Vec3f(	(corner & 1) ? local.max.x : local.min.x,
+								(corner & 2) ? local.max.y : local.min.y,
+								(corner & 4) ? local.max.z : local.min.z	);
+			primBounds[i].AddPoint(instance.ToWorldPoint(p));
+		}
+		centroids[i] = 0.5f * (primBounds[i].min + primBounds[i].max);
+	}
+
+	BuildTree();
+	ReorderInstances();
+	EndBuild();
+
+	return true;
+}
+
+void InstanceBvh::ReorderInstances() {
+	Instance *sorted = new Instance[numInstances];
+
+	for(int i = 0; i < numInstances; i++) {
+		sorted[i] = instances[primIdx[i]];
+	}
+
+	delete[] instances;
+	instances = sorted;
+}
+
+// Closest hit, through the same traversal as SceneBvh::RayBvh
+// tMax shrinks across instances, so later meshes get culled by earlier hits
+bool InstanceBvh::RayInstanceBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &instanceHit, uint &triHit, float &u, float &v) {
+	int hitIdx = -1;
+	TraverseClosest(start, dir, tMax, [&](uint first, uint count, float &tClosest) {
+		for(uint i = first; i < first + count; i++) {
+			const Instance &instance = instances[i];
+			float t, uHit, vHit;
+			uint tri;
+			if((*meshes)[instance.meshIdx].bvh->RayBvh(instance.ToLocalPoint(start), instance.ToLocalDir(dir), tClosest, t, tri, uHit, vHit)) {
+				tClosest = t;
+				hitIdx = i;
+				triHit = tri;
+				u = uHit;
+				v = vHit;
+			}
+		}
+	});
+
+	if(hitIdx < 0) {
+		return false;
+	}
+
+	tHit = tMax;
+	instanceHit = hitIdx;
+
+	return true;
+}
+
+// Any-hit, for shadow rays
+bool InstanceBvh::OccludedInstanceBvh(Vec3f start, Vec3f dir, float tMax) {
+	return TraverseAny(start, dir, tMax, [&](uint first, uint count) {
+		for(uint i = first; i < first + count; i++) {
+			const Instance &instance = instances[i];
+			if((*meshes)[instance.meshIdx].bvh->OccludedBvh(instance.ToLocalPoint(start), instance.ToLocalDir(dir), tMax)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
@@ -0,0 +1,62 @@
+#ifndef INSTANCEBVH_INCLUDED
+#define INSTANCEBVH_INCLUDED
+
+#include "Bvh.h"
+
+#include <vector>
+#include <string>
+
+// Named triangle set, declared between mesh_begin: and mesh_end:
+// Only drawn through instances, with its own bottom-level tree in object space
+struct Mesh {
+	std::string name;
+	std::vector<Triangle> triangles;
+	SceneBvh *bvh = NULL;
+};
+
+// One placement of a mesh. World = translation + scale * rotation(object)
+// Scale is uniform so normals only need the rotation
+struct Instance {
+	Vec3f ToLocalPoint(const Vec3f &p) const {
+		return invScale * invRotation.RotateVector(p - translation);
+	}
+	Vec3f ToLocalDir(const Vec3f &d) const {		// Not renormalized, so t matches the world ray
+		return invScale * invRotation.RotateVector(d);
+	}
+	Vec3f ToWorldPoint(const Vec3f &p) const {
+		return translation + scale * rotation.RotateVector(p);
+	}
+	Vec3f ToWorldNormal(const Vec3f &n) const {
+		return rotation.RotateVector(n);
+	}
+
+	uint meshIdx;
+	Quaternion rotation, invRotation;
+	Vec3f translation;
+	float scale = 1.f;
+	float invScale = 1.f;
+};
+
+// Top-level tree over the world bounds of the instances
+// Leaves hand the ray, moved into object space, to each mesh's SceneBvh
+class InstanceBvh : public BvhTree {
+public:
+	InstanceBvh() {}
+	~InstanceBvh();
+
+	InstanceBvh(const std::vector<Instance> &inputInstances, const std::vector<Mesh> &inputMeshes);
+
+	bool BuildBvh();
+
+	bool RayInstanceBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &instanceHit, uint &triHit, float &u, float &v);
+	bool OccludedInstanceBvh(Vec3f start, Vec3f dir, float tMax);
+
+	int		numInstances;
+	Instance	*instances = NULL;		// In tree order
+	const std::vector<Mesh> *meshes = NULL;		// The scene's, looked up by Instance::meshIdx so meshes added later don't leave it dangling
+
+private:
+	void ReorderInstances();
+};
+
+#endif
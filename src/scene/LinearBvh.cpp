@@ -0,0 +1,175 @@
+#include "Bvh.h"
+#include "BvhIntersect.h"
+
+#include <vector>
+#include <algorithm>
+
+#include <omp.h>
+
+#define MORTON_AXIS_BITS 21		// Centroid grid cells per axis, 2^21. Fewer leave small objects next to a big ground plane in a handful of cells
+#define LBVH_LEAF_SIZE 4
+#define LBVH_RADIX_BITS 11		// Bits per radix sort pass, six passes cover a 63-bit code
+#define LBVH_TASK_THRESHOLD 1024		// Smaller ranges are emitted by the thread that split them off
+
+// Spreads the low 21 bits of v so two zero bits sit between each of them
+static inline uint64_t ExpandBits(uint64_t v) {
+	v &= 0x1FFFFFull;
+	v = (v | (v << 32)) & 0x1F00000000FFFFull;
+	v = (v | (v << 16)) & 0x1F0000FF0000FFull;
+	v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+	v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+
+	return v;
+}
+
+// Parallel LSD radix sort of (code, primitive) pairs by code. Stable, so equal codes keep primitive order
+// Every thread counts its own block, the counts are prefix summed bucket by bucket, then each thread scatters
+static void RadixSortCodes(std::vector<uint64_t> &codes, uint *prims, uint *scratchPrims, int count) {
+	const int buckets = 1 << LBVH_RADIX_BITS;
+	std::vector<uint64_t> scratchCodes(count);
+	int maxThreads = omp_get_max_threads();
+	std::vector<int> offsets((size_t) buckets * maxThreads);
+	uint *from = prims;
+	uint *to = scratchPrims;
+
+	for(int shift = 0; shift < 3 * MORTON_AXIS_BITS; shift += LBVH_RADIX_BITS) {
+		#pragma omp parallel num_threads(maxThreads)
+		{
+			int threadCount = omp_get_num_threads();		// The team can come out smaller than asked, inside another parallel region say
+			int thread = omp_get_thread_num();
+			int begin = (int) ((long long) count * thread / threadCount);
+			int end = (int) ((long long) count * (thread + 1) / threadCount);
+			int *counts = &offsets[(size_t) thread * buckets];
+
+			std::fill(counts, counts + buckets, 0);
+			for(int i = begin; i < end; i++) {
+				counts[(codes[i] >> shift) & (buckets - 1)]++;
+			}
+
+			#pragma omp barrier
+			#pragma omp single
+			{
+				int sum = 0;
+				for(int bucket = 0; bucket < buckets; bucket++) {
+					for(int t = 0; t < threadCount; t++) {
+						int bucketCount = offsets[(size_t) t * buckets + bucket];
+						offsets[(size_t) t * buckets + bucket] = sum;
+						sum += bucketCount;
+					}
+				}
+			}
+
+			for(int i = begin; i < end; i++) {
+				int slot = counts[(codes[i] >> shift) & (buckets - 1)]++;
+				scratchCodes[slot] = codes[i];
+				to[slot] = from[i];
+			}
+		}
+
+		codes.swap(scratchCodes);
+		std::swap(from, to);
+	}
+
+	if(from != prims) {
+		std::copy(from, from + count, prims);
+	}
+}
+
+// Linear BVH: primitives sorted along a Z-curve over their centroids, then split where the
+// highest bit of the code changes. Much faster to build than SAH, and the trees trace slower
+// Called by BuildTree with the root covering every primitive in primIdx
+void BvhTree::BuildLinear() {
+	BoundBoxf centroidBounds;
+	centroidBounds.Clear();
+	for(int i = 0; i < primCount; i++) {
+		centroidBounds.AddPoint(centroids[i]);
+	}
+
+	const uint64_t maxCell = (1 << MORTON_AXIS_BITS) - 1;
+	float cells = maxCell;
+	Vec3f extent = centroidBounds.max - centroidBounds.min;
+	Vec3f scale = Vec3f(extent.x > 0 ? cells / extent.x : 0, extent.y > 0 ? cells / extent.y : 0, extent.z > 0 ? cells / extent.z : 0);
+
+	mortonCodes.resize(primCount);
+	#pragma omp parallel for
+	for(int i = 0; i < primCount; i++) {
+		Vec3f cell = centroids[i] - centroidBounds.min;
+		uint64_t x = std::min((uint64_t) (cell.x * scale.x), maxCell);		// Rounding can land one past the last cell
+		uint64_t y = std::min((uint64_t) (cell.y * scale.y), maxCell);
+		uint64_t z = std::min((uint64_t) (cell.z * scale.z), maxCell);
+		mortonCodes[i] = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+	}
+
+	RadixSortCodes(mortonCodes, primIdx, scratchIdx, primCount);
+
+	#pragma omp parallel
+	#pragma omp single
+	EmitLinear(rootIdx, 0);
+
+	std::vector<uint64_t>().swap(mortonCodes);
+}
+
+// Split point of a sorted code range: the first index whose code differs from the first one's in the highest bit
+// that varies across the range. Ranges of equal codes are just halved
+static int FindSplit(const uint64_t *codes, int first, int last) {
+	uint64_t firstCode = codes[first];
+	uint64_t lastCode = codes[last];
+	if(firstCode == lastCode) {
+		return (first + last + 1) / 2;
+	}
+
+	int commonPrefix = __builtin_clzll(firstCode ^ lastCode);
+
+	// Binary search for the last index still sharing more than commonPrefix bits with the first
+	int split = first;
+	int step = last - first;
+	do {
+		step = (step + 1) / 2;
+		int candidate = split + step;
+		if(candidate < last && __builtin_clzll(firstCode ^ codes[candidate]) > commonPrefix) {
+			split = candidate;
+		}
+	} while(step > 1);
+
+	return split + 1;
+}
+
+// Node nodeIdx holds a sorted range. Split it, recurse, then take the bounds from the children
+void BvhTree::EmitLinear(uint nodeIdx, int depth) {
+	BvhNode &node = bvhNodes[nodeIdx];
+	int first = node.firstTriangle;
+	int count = node.triangleCount;
+
+	if(count <= LBVH_LEAF_SIZE || depth >= MAX_BVH_DEPTH) {
+		CalcBounds(nodeIdx);
+		return;
+	}
+
+	int split = FindSplit(mortonCodes.data(), first, first + count - 1);
+
+	uint leftIdx;
+	#pragma omp atomic capture
+	{
+		leftIdx = nodesUsed;
+		nodesUsed += 2;
+	}
+	uint rightIdx = leftIdx + 1;
+
+	bvhNodes[leftIdx].firstTriangle = first;
+	bvhNodes[leftIdx].triangleCount = split - first;
+	bvhNodes[rightIdx].firstTriangle = split;
+	bvhNodes[rightIdx].triangleCount = first + count - split;
+	node.left = leftIdx;
+	node.triangleCount = 0;
+
+	#pragma omp task if(split - first >= LBVH_TASK_THRESHOLD)
+	EmitLinear(leftIdx, depth + 1);
+
+	EmitLinear(rightIdx, depth + 1);
+
+	#pragma omp taskwait
+
+	node.bounds = bvhNodes[leftIdx].bounds;
+	node.bounds.AddBox(bvhNodes[rightIdx].bounds);
+}
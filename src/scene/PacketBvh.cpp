@@ -0,0 +1,210 @@
+#include "Bvh.h"
+#include "BvhIntersect.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>		// SSE lanes, SSE2 for the integer triangle indices
+#endif
+
+#define PACKET_LANES 4
+#define PACKET_GROUPS (RAY_PACKET_SIZE / PACKET_LANES)
+
+// Mixed octants make the shared near/far order wrong for some rays
+static bool SameOctant(const RayPacket &packet) {
+	for(int r = 1; r < packet.count; r++) {
+		if((packet.dirX[r] < 0) != (packet.dirX[0] < 0) || (packet.dirY[r] < 0) != (packet.dirY[0] < 0) || (packet.dirZ[r] < 0) != (packet.dirZ[0] < 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#if defined(__SSE2__)
+// Lanes of group g whose ray hits the box before its closest hit so far
+// Operands are swapped against std::min/max, so a NaN slab picks the same side as IntersectBoundingBox
+static inline __m128 IntersectPacketBox(const BoundBoxf &box, const __m128 *ox, const __m128 *oy, const __m128 *oz, const __m128 *ix, const __m128 *iy, const __m128 *iz, const __m128 *tMax, int g) {
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.x), ox[g]), ix[g]);
+	__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.x), ox[g]), ix[g]);
+	__m128 tNear = _mm_min_ps(tx2, tx1);
+	__m128 tFar = _mm_max_ps(tx2, tx1);
+
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.y), oy[g]), iy[g]);
+	__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.y), oy[g]), iy[g]);
+	tNear = _mm_max_ps(_mm_min_ps(ty2, ty1), tNear);
+	tFar = _mm_min_ps(_mm_max_ps(ty2, ty1), tFar);
+
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.z), oz[g]), iz[g]);
+	__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.z), oz[g]), iz[g]);
+	tNear = _mm_max_ps(_mm_min_ps(tz2, tz1), tNear);
+	tFar = _mm_min_ps(_mm_max_ps(tz2, tz1), tFar);
+
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmplt_ps(tNear, tMax[g]));
+
+	return _mm_and_ps(hit, _mm_cmpgt_ps(tFar, _mm_setzero_ps()));
+}
+#endif
+
+void SceneBvh::RayPacketBvh(const RayPacket &packet, float tMax, TriangleHit *hits) {
+	for(int r = 0; r < packet.count; r++) {
+		hits[r].triangle = -1;
+	}
+
+#if defined(__SSE2__)
+	if(!SameOctant(packet)) {
+#endif
+		for(int r = 0; r < packet.count; r++) {
+			Vec3f start = Vec3f(packet.startX[r], packet.startY[r], packet.startZ[r]);
+			Vec3f dir = Vec3f(packet.dirX[r], packet.dirY[r], packet.dirZ[r]);
+			uint triHit;
+			TriangleHit &hit = hits[r];
+			if(RayBvh(start, dir, tMax, hit.t, triHit, hit.u, hit.v)) {
+				hit.triangle = triHit;
+			}
+		}
+		return;
+#if defined(__SSE2__)
+	}
+
+	// Unused lanes copy ray 0 and start with nothing left to find
+	alignas(16) float lane[6][RAY_PACKET_SIZE];
+	for(int r = 0; r < RAY_PACKET_SIZE; r++) {
+		int from = (r < packet.count) ? r : 0;
+		lane[0][r] = packet.startX[from];
+		lane[1][r] = packet.startY[from];
+		lane[2][r] = packet.startZ[from];
+		lane[3][r] = packet.dirX[from];
+		lane[4][r] = packet.dirY[from];
+		lane[5][r] = packet.dirZ[from];
+	}
+
+	__m128 ox[PACKET_GROUPS], oy[PACKET_GROUPS], oz[PACKET_GROUPS];
+	__m128 dx[PACKET_GROUPS], dy[PACKET_GROUPS], dz[PACKET_GROUPS];
+	__m128 ix[PACKET_GROUPS], iy[PACKET_GROUPS], iz[PACKET_GROUPS];
+	__m128 closest[PACKET_GROUPS], hitU[PACKET_GROUPS], hitV[PACKET_GROUPS];
+	__m128i hitTri[PACKET_GROUPS];
+	__m128 one = _mm_set1_ps(1.f);
+	for(int g = 0; g < PACKET_GROUPS; g++) {
+		ox[g] = _mm_load_ps(&lane[0][g * PACKET_LANES]);
+		oy[g] = _mm_load_ps(&lane[1][g * PACKET_LANES]);
+		oz[g] = _mm_load_ps(&lane[2][g * PACKET_LANES]);
+		dx[g] = _mm_load_ps(&lane[3][g * PACKET_LANES]);
+		dy[g] = _mm_load_ps(&lane[4][g * PACKET_LANES]);
+		dz[g] = _mm_load_ps(&lane[5][g * PACKET_LANES]);
+		ix[g] = _mm_div_ps(one, dx[g]);
+		iy[g] = _mm_div_ps(one, dy[g]);
+		iz[g] = _mm_div_ps(one, dz[g]);
+
+		alignas(16) float laneMax[PACKET_LANES];
+		for(int k = 0; k < PACKET_LANES; k++) {
+			laneMax[k] = (g * PACKET_LANES + k < packet.count) ? tMax : -GIANT_NUM;
+		}
+		closest[g] = _mm_load_ps(laneMax);
+		hitU[g] = hitV[g] = _mm_setzero_ps();
+		hitTri[g] = _mm_set1_epi32(-1);
+	}
+
+	__m128 parallelEps = _mm_set1_ps(FloatBound(PLANE_EQUALS_EPS));
+	__m128 rayEps = _mm_set1_ps(FloatBound(RAY_EPS));
+	__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 zero = _mm_setzero_ps();
+
+	uint stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	stack[stackPtr++] = rootIdx;
+
+	while(stackPtr > 0) {
+		const BvhNode &node = bvhNodes[stack[--stackPtr]];
+
+		__m128 boxHit[PACKET_GROUPS];
+		int masks[PACKET_GROUPS];
+		int anyHit = 0;
+		for(int g = 0; g < PACKET_GROUPS; g++) {
+			boxHit[g] = IntersectPacketBox(node.bounds, ox, oy, oz, ix, iy, iz, closest, g);
+			masks[g] = _mm_movemask_ps(boxHit[g]);
+			anyHit |= masks[g];
+		}
+		if(anyHit == 0) {
+			continue;
+		}
+
+		if(node.triangleCount == 0) {
+			// Near child last, so it is visited first. Judged along the first ray
+			uint nearIdx = node.left;
+			uint farIdx = node.left + 1;
+			const BoundBoxf &a = bvhNodes[nearIdx].bounds;
+			const BoundBoxf &b = bvhNodes[farIdx].bounds;
+			float along = (b.min.x + b.max.x - a.min.x - a.max.x) * packet.dirX[0] + (b.min.y + b.max.y - a.min.y - a.max.y) * packet.dirY[0] + (b.min.z + b.max.z - a.min.z - a.max.z) * packet.dirZ[0];
+			if(along < 0) {
+				std::swap(nearIdx, farIdx);
+			}
+
+			stack[stackPtr++] = farIdx;
+			stack[stackPtr++] = nearIdx;
+			continue;
+		}
+
+		// Same Möller-Trumbore arithmetic as IntersectTriangle, four rays at a time
+		for(uint i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++) {
+			const AccelTriangle &triangle = accelTriangles[i];
+			__m128 e1x = _mm_set1_ps(triangle.e1.x), e1y = _mm_set1_ps(triangle.e1.y), e1z = _mm_set1_ps(triangle.e1.z);
+			__m128 e2x = _mm_set1_ps(triangle.e2.x), e2y = _mm_set1_ps(triangle.e2.y), e2z = _mm_set1_ps(triangle.e2.z);
+			__m128 v1x = _mm_set1_ps(triangle.v1.x), v1y = _mm_set1_ps(triangle.v1.y), v1z = _mm_set1_ps(triangle.v1.z);
+			__m128i index = _mm_set1_epi32(i);
+
+			for(int g = 0; g < PACKET_GROUPS; g++) {
+				if(masks[g] == 0) {
+					continue;
+				}
+
+				__m128 cx = _mm_sub_ps(_mm_mul_ps(dy[g], e2z), _mm_mul_ps(dz[g], e2y));
+				__m128 cy = _mm_sub_ps(_mm_mul_ps(dz[g], e2x), _mm_mul_ps(dx[g], e2z));
+				__m128 cz = _mm_sub_ps(_mm_mul_ps(dx[g], e2y), _mm_mul_ps(dy[g], e2x));
+				__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, cx), _mm_mul_ps(e1y, cy)), _mm_mul_ps(e1z, cz));
+				__m128 valid = _mm_cmpnlt_ps(_mm_and_ps(det, absMask), parallelEps);
+				__m128 detInverse = _mm_div_ps(one, det);
+
+				__m128 sx = _mm_sub_ps(ox[g], v1x);
+				__m128 sy = _mm_sub_ps(oy[g], v1y);
+				__m128 sz = _mm_sub_ps(oz[g], v1z);
+				__m128 u = _mm_mul_ps(detInverse, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, cx), _mm_mul_ps(sy, cy)), _mm_mul_ps(sz, cz)));
+				valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+
+				__m128 c2x = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+				__m128 c2y = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+				__m128 c2z = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+				__m128 v = _mm_mul_ps(detInverse, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx[g], c2x), _mm_mul_ps(dy[g], c2y)), _mm_mul_ps(dz[g], c2z)));
+				valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+
+				__m128 t = _mm_mul_ps(detInverse, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, c2x), _mm_mul_ps(e2y, c2y)), _mm_mul_ps(e2z, c2z)));
+				valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(t, rayEps), _mm_cmpngt_ps(t, closest[g])));
+
+				// Rays that missed the box keep what they had, like the scalar traversal that never got here
+				valid = _mm_and_ps(valid, boxHit[g]);
+				if(_mm_movemask_ps(valid) == 0) {
+					continue;
+				}
+
+				closest[g] = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, closest[g]));
+				hitU[g] = _mm_or_ps(_mm_and_ps(valid, u), _mm_andnot_ps(valid, hitU[g]));
+				hitV[g] = _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, hitV[g]));
+				__m128i validInt = _mm_castps_si128(valid);
+				hitTri[g] = _mm_or_si128(_mm_and_si128(validInt, index), _mm_andnot_si128(validInt, hitTri[g]));
+			}
+		}
+	}
+
+	alignas(16) float t[RAY_PACKET_SIZE], u[RAY_PACKET_SIZE], v[RAY_PACKET_SIZE];
+	alignas(16) int tri[RAY_PACKET_SIZE];
+	for(int g = 0; g < PACKET_GROUPS; g++) {
+		_mm_store_ps(&t[g * PACKET_LANES], closest[g]);
+		_mm_store_ps(&u[g * PACKET_LANES], hitU[g]);
+		_mm_store_ps(&v[g * PACKET_LANES], hitV[g]);
+		_mm_store_si128((__m128i *) &tri[g * PACKET_LANES], hitTri[g]);
+	}
+	for(int r = 0; r < packet.count; r++) {
+		hits[r] = {t[r], u[r], v[r], tri[r]};
+	}
+#endif
+}
@@ -2,6 +2,11 @@
 
 Scene::~Scene() {
     delete bvh;
+    delete sphereBvh;
+    delete instanceBvh;
+    for(Mesh &mesh : meshes) {
+        delete mesh.bvh;
+    }
     delete[] vertexPool;
     delete[] normalPool; 
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include "ScenePrimitives.h"
 #include "Bvh.h"
+#include "SphereBvh.h"
+#include "InstanceBvh.h"
 
 #include <vector>
 #include <string>
@@ -32,7 +34,15 @@ public:
 	std::vector<PointLight>			pointLights;
 	std::vector<SpotLight>			spotLights;
 
+	// Crop window, film pixels [cropX0, cropX1) x [cropY0, cropY1). Off while empty
+	int cropX0 = 0, cropY0 = 0, cropX1 = 0, cropY1 = 0;
+	std::string cropBase;		// Image the crop gets pasted into. Empty writes the crop alone
+
 	int maxDepth; // Maximum recursion depth for reflected and refracted rays
+	float minRayWeight;	// Reflected and refracted rays that would add less than this to any channel are not traced
+	int samplesPerPixel;	// Camera rays averaged per pixel, or the first batch when adaptive
+	int maxSamplesPerPixel;	// Adaptive sampling stops here. Not above samplesPerPixel means off
+	float adaptiveThreshold;	// Adaptive sampling stops once the pixel's standard error is below this
 
 	// These set the size of the vertex and normal pools
 	int maxVertices;
@@ -49,6 +59,18 @@ public:
 	SceneBvh *bvh;
 	bool hasBvh = false;
 	bool accelerate = false;
+
+	SphereBvh *sphereBvh = NULL;
+	bool hasSphereBvh = false;
+
+	// Meshes are only drawn through instances, which always go through their trees
+	std::vector<Mesh> meshes;
+	std::vector<Instance> instances;
+	InstanceBvh *instanceBvh = NULL;
+	bool hasInstanceBvh = false;
+
+	BvhBuildMode bvhBuildMode = BVH_BUILD_SAH;
+	int bvhBinCount = SAH_BIN_COUNT;
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,10 @@
 #include <fstream>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+
+#include <omp.h>
 
 std::vector<std::string> SceneLoader::ParseArgsFromLine(std::string line) {
 	std::vector<std::string> args;
@@ -24,6 +28,83 @@ std::vector<std::string> SceneLoader::ParseArgsFromLine(std::string line) {
 }
 
 
+// The directives that say where a render looks and where it goes
+// Shared with batch files, which only carry these
+bool SceneLoader::ParseViewDirective(const std::vector<std::string> &args, Camera &camera, int &width, int &height, std::string &outputImage) {
+	if(args[0] == "camera_pos:") {
+		camera.eye = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
+	}
+	else if(args[0] == "camera_fwd:") {
+		camera.fwd = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
+	}
+	else if(args[0] == "camera_up:") {
+		camera.up = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
+	}
+	else if(args[0] == "camera_fov_ha:") {
+		camera.halfAngleFov = stof(args[1]);
+	}
+	else if(args[0] == "film_resolution:") {
+		width = stoi(args[1]);
+		height = stoi(args[2]);
+	}
+	else if(args[0] == "output_image:") {
+		outputImage = args[1];
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+// Lights, ambient and background. Shared with the render server, which can change them between renders
+bool SceneLoader::ParseLightDirective(const std::vector<std::string> &args, Scene *scene) {
+	if(args[0] == "directional_light:") {
+		DirectionalLight directionalLight;
+		directionalLight.intensity = Color(stof(args[1]), stof(args[2]), stof(args[3]));
+		directionalLight.direction = Vec3f(stof(args[4]), stof(args[5]), stof(args[6]));
+
+		scene->directionalLights.push_back(directionalLight);
+	}
+	else if(args[0] == "point_light:") {
+		PointLight pointLight;
+		pointLight.intensity = Color(stof(args[1]), stof(args[2]), stof(args[3]));
+		pointLight.origin = Vec3f(stof(args[4]), stof(args[5]), stof(args[6]));
+
+		scene->pointLights.push_back(pointLight);
+	}
+	else if(args[0] == "spot_light:") {
+		SpotLight spotLight;
+		spotLight.intensity = Color(stof(args[1]), stof(args[2]), stof(args[3]));
+		spotLight.origin = Vec3f(stof(args[4]), stof(args[5]), stof(args[6]));
+		spotLight.direction = Vec3f(stof(args[7]), stof(args[8]), stof(args[9]));
+		spotLight.angle1 = stof(args[10]);
+		spotLight.angle2 = stof(args[11]);
+
+		scene->spotLights.push_back(spotLight);
+	}
+	else if(args[0] == "ambient_light:") {
+		scene->ambient = Color(stof(args[1]), stof(args[2]), stof(args[3]));
+	}
+	else if(args[0] == "background:") {
+		scene->background = Color(stof(args[1]), stof(args[2]), stof(args[3]));
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+// Create an orthonormal camera basis based on the provided up and forward
+void SceneLoader::FinishCamera(Camera &camera) {
+	camera.right = (camera.up).Cross(camera.fwd);
+	(camera.right).Normalize();
+	camera.up = (camera.fwd).Cross(camera.right);
+	(camera.up).Normalize();
+	(camera.fwd).Normalize();
+}
+
 Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 	std::ifstream file(fileName);
 
@@ -40,14 +121,16 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 	raytracerScene->imageWidth = 640;
 	raytracerScene->imageHeight = 480;
 	raytracerScene->maxDepth = 5;
+	raytracerScene->samplesPerPixel = 1;
+	raytracerScene->maxSamplesPerPixel = 0;
+	raytracerScene->adaptiveThreshold = DEFAULT_ADAPTIVE_THRESHOLD;
+	raytracerScene->minRayWeight = DEFAULT_MIN_RAY_WEIGHT;
 
 	// Default is no ambient
-	AmbientLight sceneAmbient;
-	sceneAmbient = Color(0, 0, 0);
+	raytracerScene->ambient = Color(0, 0, 0);
 
 	// Default is black
-	Background sceneBackground;
-	sceneBackground = Color(0, 0, 0);
+	raytracerScene->background = Color(0, 0, 0);
 
 	Camera sceneCamera;
 	sceneCamera.eye = Vec3f(0, 0, 0);
@@ -66,6 +149,9 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 	currentMaterial.refractionCoeff = 1;
 
 
+	// Triangles go here while inside mesh_begin:/mesh_end:
+	std::vector<Triangle> *triangleTarget = &raytracerScene->triangles;
+
 	std::string line;
 	while(std::getline(file, line)) {		// Process all of the arguments
 		std::vector<std::string> args;
@@ -73,24 +159,8 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 		args = ParseArgsFromLine(line);
 
 		if(!(args.empty() || args[0][0] == '#')) {    // Otherwise, skip it. It's a comment
-			if(args[0] == "camera_pos:") {
-				sceneCamera.eye = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
-			}
-			else if(args[0] == "camera_fwd:") {
-				sceneCamera.fwd = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
-			}
-			else if(args[0] == "camera_up:") {
-				sceneCamera.up = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
-			}
-			else if(args[0] == "camera_fov_ha:") {
-				sceneCamera.halfAngleFov = stof(args[1]);
-			}
-			else if(args[0] == "film_resolution:") {
-				raytracerScene->imageWidth = stoi(args[1]);
-				raytracerScene->imageHeight = stoi(args[2]);				
-			}
-			else if(args[0] == "output_image:") {
-				raytracerScene->outputImage = args[1].c_str();
+			if(ParseViewDirective(args, sceneCamera, raytracerScene->imageWidth, raytracerScene->imageHeight, raytracerScene->outputImage)) {
+				// Camera, film or output
 			}
 			else if(args[0] == "max_vertices:") {
 				raytracerScene->maxVertices = stoi(args[1]);
@@ -124,7 +194,7 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 				// Pre-process the plane
 				triangle.CreatePlane();
 
-				raytracerScene->triangles.push_back(triangle);
+				triangleTarget->push_back(triangle);
 			}
 			else if(args[0] == "normal_triangle:") {
 				Triangle normalTriangle;
@@ -143,9 +213,12 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 				// Pre-process the plane
 				normalTriangle.CreatePlane();
 
-				raytracerScene->triangles.push_back(normalTriangle);
+				triangleTarget->push_back(normalTriangle);
 
 			}
+			else if(ParseLightDirective(args, raytracerScene)) {
+				// Lights, ambient or background
+			}
 			else if(args[0] == "sphere:") {
 				Sphere sphere;
 				sphere.origin = Vec3f(stof(args[1]), stof(args[2]), stof(args[3]));
@@ -154,9 +227,6 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 
 				raytracerScene->spheres.push_back(sphere);
 			}
-			else if(args[0] == "background:") {
-				sceneBackground = Color(stof(args[1]), stof(args[2]), stof(args[3]));
-			}
 			else if(args[0] == "material:") {
 				currentMaterial.ambient = Color(stof(args[1]), stof(args[2]), stof(args[3]));
 				currentMaterial.diffuse = Color(stof(args[4]), stof(args[5]), stof(args[6]));
@@ -165,58 +235,145 @@ Scene *SceneLoader::ParseSceneFile(const char *fileName) {
 				currentMaterial.transmissive = Color(stof(args[11]), stof(args[12]), stof(args[13]));
 				currentMaterial.refractionCoeff = stof(args[14]);
 			}
-			else if(args[0] == "directional_light:") {
-				DirectionalLight directionalLight;
-				directionalLight.intensity = Color(stof(args[1]), stof(args[2]), stof(args[3]));
-				directionalLight.direction = Vec3f(stof(args[4]), stof(args[5]), stof(args[6]));
-
-				raytracerScene->directionalLights.push_back(directionalLight);
+			else if(args[0] == "max_depth:") {
+				raytracerScene->maxDepth = stoi(args[1]);
 			}
-			else if(args[0] == "point_light:") {
-				PointLight pointLight;
-				pointLight.intensity = Color(stof(args[1]), stof(args[2]), stof(args[3]));
-				pointLight.origin = Vec3f(stof(args[4]), stof(args[5]), stof(args[6]));
-
-				raytracerScene->pointLights.push_back(pointLight);
+			else if(args[0] == "crop_window:") {		// x0 y0 x1 y1 [base_image]
+				raytracerScene->cropX0 = stoi(args[1]);
+				raytracerScene->cropY0 = stoi(args[2]);
+				raytracerScene->cropX1 = stoi(args[3]);
+				raytracerScene->cropY1 = stoi(args[4]);
+				if(args.size() > 5) {
+					raytracerScene->cropBase = args[5];
+				}
 			}
-			else if(args[0] == "spot_light:") {
-				SpotLight spotLight;
-				spotLight.intensity = Color(stof(args[1]), stof(args[2]), stof(args[3]));
-				spotLight.origin = Vec3f(stof(args[4]), stof(args[5]), stof(args[6]));
-				spotLight.direction = Vec3f(stof(args[7]), stof(args[8]), stof(args[9]));
-				spotLight.angle1 = stof(args[10]);
-				spotLight.angle2 = stof(args[11]);
-
-				raytracerScene->spotLights.push_back(spotLight);
+			else if(args[0] == "min_ray_weight:") {
+				raytracerScene->minRayWeight = std::max(stof(args[1]), 0.f);
 			}
-			else if(args[0] == "ambient_light:") {
-				sceneAmbient = Color(stof(args[1]), stof(args[2]), stof(args[3]));
+			else if(args[0] == "samples_per_pixel:") {
+				raytracerScene->samplesPerPixel = std::max(stoi(args[1]), 1);
 			}
-			else if(args[0] == "max_depth:") {
-				raytracerScene->maxDepth = stoi(args[1]);
+			else if(args[0] == "adaptive_samples:") {		// max [threshold]
+				raytracerScene->maxSamplesPerPixel = stoi(args[1]);
+				if(args.size() > 2) {
+					raytracerScene->adaptiveThreshold = stof(args[2]);
+				}
+			}
+			else if(args[0] == "bvh_builder:") {
+				if(args[1] == "midpoint") {
+					raytracerScene->bvhBuildMode = BVH_BUILD_MIDPOINT;
+				}
+				else if(args[1] == "sah") {
+					raytracerScene->bvhBuildMode = BVH_BUILD_SAH;
+				}
+				else if(args[1] == "lbvh") {
+					raytracerScene->bvhBuildMode = BVH_BUILD_LBVH;
+				}
+				else {
+					std::cerr << "Unknown bvh_builder: " << args[1] << std::endl;
+				}
+			}
+			else if(args[0] == "bvh_bins:") {
+				raytracerScene->bvhBinCount = stoi(args[1]);
+			}
+			else if(args[0] == "mesh_begin:") {
+				Mesh mesh;
+				mesh.name = args[1];
+				raytracerScene->meshes.push_back(mesh);
+				triangleTarget = &raytracerScene->meshes.back().triangles;
+			}
+			else if(args[0] == "mesh_end:") {
+				triangleTarget = &raytracerScene->triangles;
+			}
+			else if(args[0] == "instance:") {		// name tx ty tz [ax ay az angle [scale]]
+				int meshIdx = -1;
+				for(uint i = 0; i < raytracerScene->meshes.size(); i++) {
+					if(raytracerScene->meshes[i].name == args[1]) {
+						meshIdx = i;
+					}
+				}
+				if(meshIdx < 0) {
+					std::cerr << "Unknown mesh for instance: " << args[1] << std::endl;
+					continue;
+				}
+
+				Instance instance;
+				instance.meshIdx = meshIdx;
+				instance.translation = Vec3f(stof(args[2]), stof(args[3]), stof(args[4]));
+				if(args.size() > 8) {
+					Vec3f axis = Vec3f(stof(args[5]), stof(args[6]), stof(args[7]));
+					axis.Normalize();
+					instance.rotation = Quaternion(axis, stof(args[8]) * (M_PI / 180.0f));
+					instance.rotation.Normalize();
+					instance.invRotation = instance.rotation.GetConjugate();
+				}
+				if(args.size() > 9) {
+					instance.scale = stof(args[9]);
+					instance.invScale = 1.f / instance.scale;
+					if(!std::isfinite(instance.scale) || !std::isfinite(instance.invScale)) {		// Zero would send every ray to infinity in object space
+						std::cerr << "Instance scale must be finite and nonzero, skipping instance of " << args[1] << std::endl;
+						continue;
+					}
+				}
+
+				raytracerScene->instances.push_back(instance);
 			}
 		}
 	}
 
-	// Apply Ambient and Background to the raytracer scene
-	raytracerScene->ambient = sceneAmbient;
-	raytracerScene->background = sceneBackground;
-
-	// Create an orthonormal camera basis based on the provided up and forward
-	sceneCamera.right = (sceneCamera.up).Cross(sceneCamera.fwd);
-	(sceneCamera.right).Normalize();
-	sceneCamera.up = (sceneCamera.fwd).Cross(sceneCamera.right);
-	(sceneCamera.up).Normalize();
-	(sceneCamera.fwd).Normalize();
-
+	FinishCamera(sceneCamera);
 	raytracerScene->camera = sceneCamera;
 
+	double buildStart = omp_get_wtime();
 	raytracerScene->bvh = new SceneBvh(raytracerScene->triangles);
+	raytracerScene->bvh->buildMode = raytracerScene->bvhBuildMode;
+	raytracerScene->bvh->binCount = raytracerScene->bvhBinCount;
+	raytracerScene->bvh->cacheDir = bvhCacheDir;
 	raytracerScene->hasBvh = (*raytracerScene->bvh).BuildBvh();
 
+	raytracerScene->sphereBvh = new SphereBvh(raytracerScene->spheres);
+	raytracerScene->sphereBvh->buildMode = raytracerScene->bvhBuildMode;
+	raytracerScene->sphereBvh->binCount = raytracerScene->bvhBinCount;
+	raytracerScene->hasSphereBvh = raytracerScene->sphereBvh->BuildBvh();
+
+	// Bottom level first, the top level is built over their placed bounds
+	uint instanceNodes = 0;
+	std::vector<Instance> placedInstances;
+	for(Mesh &mesh : raytracerScene->meshes) {
+		mesh.bvh = new SceneBvh(mesh.triangles);
+		mesh.bvh->buildMode = raytracerScene->bvhBuildMode;
+		mesh.bvh->binCount = raytracerScene->bvhBinCount;
+		mesh.bvh->cacheDir = bvhCacheDir;
+		if(mesh.bvh->BuildBvh()) {
+			instanceNodes += mesh.bvh->nodesUsed;
+		}
+	}
+	for(const Instance &instance : raytracerScene->instances) {
+		if(raytracerScene->meshes[instance.meshIdx].triangles.empty()) {		// Nothing to hit
+			continue;
+		}
+		placedInstances.push_back(instance);
+	}
+	raytracerScene->instanceBvh = new InstanceBvh(placedInstances, raytracerScene->meshes);
+	raytracerScene->instanceBvh->buildMode = raytracerScene->bvhBuildMode;
+	raytracerScene->instanceBvh->binCount = raytracerScene->bvhBinCount;
+	raytracerScene->hasInstanceBvh = raytracerScene->instanceBvh->BuildBvh();
+	if(raytracerScene->hasInstanceBvh) {
+		instanceNodes += raytracerScene->instanceBvh->nodesUsed;
+	}
+	double buildEnd = omp_get_wtime();
+
 	file.close();
 
 	std::cout << "Number of triangles: " << raytracerScene->triangles.size() << std::endl;
+	std::cout << "Number of spheres: " << raytracerScene->spheres.size() << std::endl;
+	if(!raytracerScene->instances.empty()) {
+		std::cout << "Number of meshes: " << raytracerScene->meshes.size() << ", instances: " << raytracerScene->instances.size() << std::endl;
+	}
+	if(raytracerScene->hasBvh || raytracerScene->hasSphereBvh || raytracerScene->hasInstanceBvh) {
+		uint nodes = (raytracerScene->hasBvh ? raytracerScene->bvh->nodesUsed : 0) + (raytracerScene->hasSphereBvh ? raytracerScene->sphereBvh->nodesUsed : 0) + instanceNodes;
+		std::cout << "BVH nodes: " << nodes << ", built in " << buildEnd - buildStart << " seconds" << std::endl;
+	}
 	std::cout << "File Parsing Success" << std::endl;
 
 	return raytracerScene;
@@ -5,14 +5,20 @@
 #include <string>
 
 #define MAX_ARGS 15
+#define DEFAULT_ADAPTIVE_THRESHOLD 0.01f		// Standard error of pixel luminance
+#define DEFAULT_MIN_RAY_WEIGHT (1.f / 512)		// Reflected and refracted rays weighing less are dropped. Under half an 8-bit step
 
 // Loader class for scenes
 class SceneLoader {
 public:
 	Scene *ParseSceneFile(const char *fileName);
 
-private:
+	std::string bvhCacheDir;		// Empty means always build
+
 	std::vector<std::string> ParseArgsFromLine(std::string line);
+	bool ParseViewDirective(const std::vector<std::string> &args, Camera &camera, int &width, int &height, std::string &outputImage);
+	bool ParseLightDirective(const std::vector<std::string> &args, Scene *scene);
+	static void FinishCamera(Camera &camera);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "SphereBvh.h"
+#include "BvhIntersect.h"
+
+SphereBvh::SphereBvh(const std::vector<Sphere> &inputSpheres) {
+	numSpheres = inputSpheres.size();
+	if(numSpheres == 0) {
+		return;
+	}
+	spheres = new Sphere[numSpheres];
+
+	for(int i = 0; i < numSpheres; i++) {
+		spheres[i] = inputSpheres[i];
+	}
+}
+
+SphereBvh::~SphereBvh() {
+	delete[] spheres;
+	delete[] accelSpheres;
+}
+
+bool SphereBvh::BuildBvh() {
+
+	if(numSpheres == 0) {
+		return false;
+	}
+
+	BeginBuild(numSpheres);
+
+	#pragma omp parallel for
+	for(int i = 0; i < numSpheres; i++) {
+		Sphere &sphere = spheres[i];
+		Vec3f extent = Vec3f(sphere.r, sphere.r, sphere.r);
+		centroids[i] = sphere.origin;
+		primBounds[i].min = sphere.origin - extent;
+		primBounds[i].max = sphere.origin + extent;
+	}
+
+	BuildTree();
+	ReorderSpheres();
+	EndBuild();
+
+	return true;
+}
+
+void SphereBvh::ReorderSpheres() {
+	Sphere *sorted = new Sphere[numSpheres];
+	accelSpheres = new AccelSphere[numSpheres];
+
+	#pragma omp parallel for
+	for(int i = 0; i < numSpheres; i++) {
+		Sphere &sphere = spheres[primIdx[i]];
+		sorted[i] = sphere;
+		accelSpheres[i].origin = sphere.origin;
+		accelSpheres[i].r = sphere.r;
+	}
+
+	delete[] spheres;
+	spheres = sorted;
+}
+
+// Closest hit, through the same traversal as SceneBvh::RayBvh
+bool SphereBvh::RaySphereBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &sphereHit) {
+	int hitIdx = -1;
+	TraverseClosest(start, dir, tMax, [&](uint first, uint count, float &tClosest) {
+		for(uint i = first; i < first + count; i++) {
+			float t;
+			if(IntersectSphere(start, dir, accelSpheres[i], tClosest, t)) {
+				tClosest = t;
+				hitIdx = i;
+			}
+		}
+	});
+
+	if(hitIdx < 0) {
+		return false;
+	}
+
+	tHit = tMax;
+	sphereHit = hitIdx;
+
+	return true;
+}
+
+// Any-hit, for shadow rays
+bool SphereBvh::OccludedSphereBvh(Vec3f start, Vec3f dir, float tMax) {
+	return TraverseAny(start, dir, tMax, [&](uint first, uint count) {
+		for(uint i = first; i < first + count; i++) {
+			float t;
+			if(IntersectSphere(start, dir, accelSpheres[i], tMax, t)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
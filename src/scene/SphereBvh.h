@@ -0,0 +1,36 @@
+#ifndef SPHEREBVH_INCLUDED
+#define SPHEREBVH_INCLUDED
+
+#include "Bvh.h"
+
+#include <vector>
+
+// Centre and radius only, for traversal
+struct AccelSphere {
+	Vec3f origin;
+	float r;
+};
+
+// A second tree just for spheres
+// Queried after the triangle BVH, with tMax already cut down to the triangle hit
+class SphereBvh : public BvhTree {
+public:
+	SphereBvh() {}
+	~SphereBvh();
+
+	SphereBvh(const std::vector<Sphere> &inputSpheres);
+
+	bool BuildBvh();
+
+	bool RaySphereBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &sphereHit);
+	bool OccludedSphereBvh(Vec3f start, Vec3f dir, float tMax);
+
+	int		numSpheres;
+	Sphere		*spheres = NULL;			// Full spheres for shading, in tree order
+	AccelSphere	*accelSpheres = NULL;		// Same order, for traversal
+
+private:
+	void ReorderSpheres();
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "Bvh.h"
+#include "BvhIntersect.h"
+
+#if defined(__SSE__)
+#include <xmmintrin.h>		// SSE slab tests
+#endif
+
+// Unused slots hold a point box out here, which no ray can reach before MAX_T
+#define EMPTY_SLOT_POS GIANT_NUM
+
+void SceneBvh::CollapseWide() {
+	if(nodesUsed == 0 || numTris == 0) {
+		return;
+	}
+
+	delete[] wideNodes;
+	wideNodes = new WideBvhNode[nodesUsed];		// Never needs more than the binary tree
+	wideNodesUsed = 1;
+
+	CollapseNode(rootIdx, 0);
+}
+
+// Fill wide node wideIdx with up to four descendants of binary node nodeIdx
+void SceneBvh::CollapseNode(uint nodeIdx, uint wideIdx) {
+	uint children[WIDE_BVH_WIDTH];
+	int childCount = 0;
+
+	BvhNode &node = bvhNodes[nodeIdx];
+	if(node.triangleCount > 0) {		// Only happens for a root that is a leaf
+		children[childCount++] = nodeIdx;
+	}
+	else {
+		children[childCount++] = node.left;
+		children[childCount++] = node.left + 1;
+
+		// Keep opening the biggest inner child until the node is full
+		while(childCount < WIDE_BVH_WIDTH) {
+			int best = -1;
+			float bestArea = -1.f;
+			for(int k = 0; k < childCount; k++) {
+				BvhNode &child = bvhNodes[children[k]];
+				if(child.triangleCount == 0 && child.bounds.Area() > bestArea) {
+					best = k;
+					bestArea = child.bounds.Area();
+				}
+			}
+			if(best < 0) {
+				break;
+			}
+
+			uint opened = children[best];
+			children[best] = bvhNodes[opened].left;
+			children[childCount++] = bvhNodes[opened].left + 1;
+		}
+	}
+
+	WideBvhNode &wide = wideNodes[wideIdx];
+	for(int k = 0; k < WIDE_BVH_WIDTH; k++) {
+		if(k >= childCount) {
+			wide.minX[k] = wide.minY[k] = wide.minZ[k] = EMPTY_SLOT_POS;
+			wide.maxX[k] = wide.maxY[k] = wide.maxZ[k] = EMPTY_SLOT_POS;
+			wide.child[k] = 0;
+			wide.count[k] = 0;
+			continue;
+		}
+
+		BvhNode &child = bvhNodes[children[k]];
+		wide.minX[k] = child.bounds.min.x;
+		wide.minY[k] = child.bounds.min.y;
+		wide.minZ[k] = child.bounds.min.z;
+		wide.maxX[k] = child.bounds.max.x;
+		wide.maxY[k] = child.bounds.max.y;
+		wide.maxZ[k] = child.bounds.max.z;
+
+		if(child.triangleCount > 0) {
+			wide.child[k] = child.firstTriangle;
+			wide.count[k] = child.triangleCount;
+		}
+		else {
+			uint childIdx = wideNodesUsed++;
+			wide.child[k] = childIdx;
+			wide.count[k] = 0;
+			CollapseNode(children[k], childIdx);
+		}
+	}
+}
+
+// Slab test on all four children at once
+// Fills in entry distances, GIANT_NUM for the ones that are missed or start past tMax
+static inline void IntersectWideNode(const WideBvhNode &node, const Vec3f &start, const Vec3f &invDir, float tMax, float *tEntry) {
+#if defined(__SSE__)
+	__m128 ox = _mm_set1_ps(start.x);
+	__m128 oy = _mm_set1_ps(start.y);
+	__m128 oz = _mm_set1_ps(start.z);
+	__m128 ix = _mm_set1_ps(invDir.x);
+	__m128 iy = _mm_set1_ps(invDir.y);
+	__m128 iz = _mm_set1_ps(invDir.z);
+
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX), ox), ix);
+	__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX), ox), ix);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY), oy), iy);
+	__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY), oy), iy);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ), oz), iz);
+	__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ), oz), iz);
+
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmplt_ps(tNear, _mm_set1_ps(tMax)));
+	hit = _mm_and_ps(hit, _mm_cmpgt_ps(tFar, _mm_setzero_ps()));
+
+	_mm_storeu_ps(tEntry, _mm_or_ps(_mm_and_ps(hit, tNear), _mm_andnot_ps(hit, _mm_set1_ps(GIANT_NUM))));
+#else
+	for(int k = 0; k < WIDE_BVH_WIDTH; k++) {
+		BoundBoxf box;
+		box.min = Vec3f(node.minX[k], node.minY[k], node.minZ[k]);
+		box.max = Vec3f(node.maxX[k], node.maxY[k], node.maxZ[k]);
+		tEntry[k] = IntersectBoundingBox(start, invDir, box, tMax);
+	}
+#endif
+}
+
+// Closest hit on the wide tree
+// Hit children go on the stack farthest first, so the nearest one is popped next
+bool SceneBvh::RayWideBvh(Vec3f start, Vec3f dir, float tMax, float &tHit, uint &triHit, float &u, float &v) {
+	struct StackEntry {
+		uint child, count;
+		float tEntry;
+	};
+
+	Vec3f invDir = Vec3f(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+
+	StackEntry stack[BVH_STACK_SIZE * (WIDE_BVH_WIDTH - 1)];
+	int stackPtr = 0;
+	stack[stackPtr++] = {0, 0, 0.f};
+	int hitIdx = -1;
+
+	while(stackPtr > 0) {
+		StackEntry entry = stack[--stackPtr];
+		if(!(entry.tEntry < tMax)) {		// A closer hit turned up since this was pushed
+			continue;
+		}
+
+		if(entry.count > 0) {		// In a leaf
+			IntersectLeaf(start, dir, entry.child, entry.count, tMax, u, v, hitIdx);
+			continue;
+		}
+
+		const WideBvhNode &node = wideNodes[entry.child];
+		alignas(16) float tEntry[WIDE_BVH_WIDTH];
+		IntersectWideNode(node, start, invDir, tMax, tEntry);
+
+		// Insertion sort the hit slots, farthest first
+		int order[WIDE_BVH_WIDTH];
+		int hits = 0;
+		for(int k = 0; k < WIDE_BVH_WIDTH; k++) {
+			if(tEntry[k] == GIANT_NUM) {
+				continue;
+			}
+			int h = hits++;
+			while(h > 0 && tEntry[order[h - 1]] < tEntry[k]) {
+				order[h] = order[h - 1];
+				h--;
+			}
+			order[h] = k;
+		}
+
+		for(int h = 0; h < hits; h++) {
+			int k = order[h];
+			stack[stackPtr++] = {node.child[k], node.count[k], tEntry[k]};
+		}
+	}
+
+	if(hitIdx < 0) {
+		return false;
+	}
+
+	tHit = tMax;
+	triHit = hitIdx;
+
+	return true;
+}
+
+// Any-hit on the wide tree, for shadow rays
+bool SceneBvh::OccludedWideBvh(Vec3f start, Vec3f dir, float tMax) {
+	struct StackEntry {
+		uint child, count;
+	};
+
+	Vec3f invDir = Vec3f(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+
+	StackEntry stack[BVH_STACK_SIZE * (WIDE_BVH_WIDTH - 1)];
+	int stackPtr = 0;
+	stack[stackPtr++] = {0, 0};
+
+	while(stackPtr > 0) {
+		StackEntry entry = stack[--stackPtr];
+
+		if(entry.count > 0) {
+			if(OccludedLeaf(start, dir, entry.child, entry.count, tMax)) {
+				return true;
+			}
+			continue;
+		}
+
+		const WideBvhNode &node = wideNodes[entry.child];
+		alignas(16) float tEntry[WIDE_BVH_WIDTH];
+		IntersectWideNode(node, start, invDir, tMax, tEntry);
+
+		for(int k = 0; k < WIDE_BVH_WIDTH; k++) {
+			if(tEntry[k] != GIANT_NUM) {
+				stack[stackPtr++] = {node.child[k], node.count[k]};
+			}
+		}
+	}
+
+	return false;
+}